@@ -6,8 +6,8 @@
 static void hashfs_anidb_setup (hashfs_backend_t *backend);
 static gboolean hashfs_anidb_init (hashfs_backend_t *backend);
 static void hashfs_anidb_destroy (hashfs_backend_t *backend);
-static void hashfs_anidb_handle_file (hashfs_backend_t *backend,
-                                      hashfs_file_t *file);
+static gboolean hashfs_anidb_handle_file (hashfs_backend_t *backend,
+                                          hashfs_file_t *file);
 
 static void dump_result (anidb_result_t *result);
 
@@ -26,6 +26,7 @@ hashfs_anidb_setup (hashfs_backend_t *backend)
 	backend->funcs.init = hashfs_anidb_init;
 	backend->funcs.file = hashfs_anidb_handle_file;
 	backend->funcs.destroy = hashfs_anidb_destroy;
+	backend->hash_types = HASHFS_HASH_ED2K;
 
 	hashfs_backend_config_register(backend, "username", "");
 	hashfs_backend_config_register(backend, "password", "");
@@ -113,22 +114,23 @@ hashfs_anidb_destroy (hashfs_backend_t *backend)
 	}
 }
 
-static void
+static gboolean
 hashfs_anidb_handle_file (hashfs_backend_t *backend, hashfs_file_t *file)
 {
 	hashfs_anidb_data_t *data;
 	const gchar *hash, *resolved;
+	gboolean rval = FALSE;
 
-	g_return_if_fail(backend);
+	g_return_val_if_fail(backend, FALSE);
 
 	data = (hashfs_anidb_data_t *) backend->data;
 
-	g_return_if_fail(data);
+	g_return_val_if_fail(data, FALSE);
 
 	/* File is marked as resolved, don't hash or lookup data */
 	if (hashfs_file_prop_lookup(file, "anidb:resolved", &resolved)) {
 		if (atoi(resolved) > 0)
-			return;
+			return TRUE;
 	}
 
 	if (anidb_session_is_logged_in(data->session)) {
@@ -189,9 +191,15 @@ hashfs_anidb_handle_file (hashfs_backend_t *backend, hashfs_file_t *file)
 			else
 				hashfs_file_prop_set(file, "anidb:resolved", "0");
 
+			/* Known or not, AniDB has answered for the file */
+			rval = anidb_result_get_type(res) == ANIDB_RESULT_DICT ||
+			       anidb_result_get_code(res) == ANIDB_NO_SUCH_FILE;
+
 			anidb_result_unref(res);
 		}
 	}
+
+	return rval;
 }
 
 static void
@@ -128,6 +128,35 @@ hashfs_backends_lookup (const gchar *name)
 	return NULL;
 }
 
+hashfs_backend_t *
+hashfs_backends_get (gint idx)
+{
+	return g_list_nth_data(backends, idx);
+}
+
+gint
+hashfs_backends_count (void)
+{
+	return g_list_length(backends);
+}
+
+/* Every digest asked for by any loaded backend */
+gint
+hashfs_backends_hash_types (void)
+{
+	hashfs_backend_t *backend;
+	GList *item;
+	gint types = 0;
+
+	for (item = g_list_first(backends); item; item = g_list_next(item)) {
+		backend = item->data;
+
+		types |= backend->hash_types;
+	}
+
+	return types;
+}
+
 void
 hashfs_backends_destroy (void)
 {
@@ -151,46 +180,60 @@ hashfs_backend_init (hashfs_backend_t *backend)
 	}
 }
 
-void
+gboolean
 hashfs_backend_file (hashfs_backend_t *backend, hashfs_file_t *file)
 {
 	if (backend->funcs.file) {
-		backend->funcs.file(backend, file);
+		return backend->funcs.file(backend, file);
 	}
+
+	return TRUE;
 }
 
 void
 hashfs_backend_glob_set (hashfs_backend_t *backend, ...)
 {
-	GPatternSpec *spec;
 	va_list va;
 
 
 	va_start(va, backend);
 
+	if (!backend->glob)
+		backend->glob = hashfs_glob_new();
+
 	for (gchar *str = va_arg(va, char *); str; str = va_arg(va, char *)) {
 		HASHFS_DEBUG("Backend (%s) accepting glob: %s", backend->desc->shortname, str);
 
-		spec = g_pattern_spec_new(str);
+		hashfs_glob_add(backend->glob, str, backend);
 
-		backend->globs = g_list_append(backend->globs, spec);
+		backend->globs = g_list_append(backend->globs, g_strdup(str));
 	}
+
+	va_end(va);
 }
 
 gboolean
 hashfs_backend_glob_try (hashfs_backend_t *backend, const gchar *filename)
 {
-	GPatternSpec *spec;
-	GList *item;
+	GList *matched;
+	gboolean rval;
 
-	for (item = g_list_first(backend->globs); item; item = g_list_next(item)) {
-		spec = item->data;
+	if (!backend->glob)
+		return FALSE;
 
-		if (g_pattern_match_string(spec, filename))
-			return TRUE;
-	}
+	matched = hashfs_glob_match(backend->glob, filename);
+	rval = matched != NULL;
+	g_list_free(matched);
 
-	return FALSE;
+	return rval;
+}
+
+/* Add the globs of backend to one shared with others */
+void
+hashfs_backend_glob_add (hashfs_backend_t *backend, hashfs_glob_t *glob)
+{
+	for (GList *item = backend->globs; item; item = g_list_next(item))
+		hashfs_glob_add(glob, item->data, backend);
 }
 
 void
@@ -203,18 +246,10 @@ hashfs_backend_destroy (hashfs_backend_t *backend)
 	if (backend->module)
 		g_module_close(backend->module);
 
-	if (backend->globs) {
-		GPatternSpec *spec;
-		GList *item;
-
-		for (item = g_list_first(backend->globs); item; item = g_list_next(item)) {
-			spec = item->data;
+	if (backend->glob)
+		hashfs_glob_destroy(backend->glob);
 
-			g_pattern_spec_free(spec);
-		}
-
-		g_list_free(backend->globs);
-	}
+	g_list_free_full(backend->globs, g_free);
 
 	g_free(backend);
 }
@@ -223,9 +258,7 @@ void
 hashfs_backend_config_register (hashfs_backend_t *backend, const gchar *key,
                                 const gchar *defaultval)
 {
-	if (!hashfs_config_property_exists(backend->desc->shortname, key)) {
-		hashfs_config_property_set(backend->desc->shortname, key, defaultval);
-	}
+	hashfs_config_property_register(backend->desc->shortname, key, defaultval);
 }
 
 void
@@ -0,0 +1,85 @@
+#ifndef _HASHFS_BENCH_H
+#define _HASHFS_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* Minimum time spent on each benchmark */
+#define HASHFS_BENCH_NS G_GINT64_CONSTANT(500000000)
+
+static inline gint64
+hashfs_bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+/* One JSON object per line, params is a list of "key": value pairs.
+   Pass 0 bytes for benchmarks that aren't about throughput */
+static inline void
+hashfs_bench_report (const gchar *bench, const gchar *params, gint64 ops,
+                     gint64 ns, gint64 bytes)
+{
+	printf("{\"suite\": \"hashfs\", \"bench\": \"%s\", \"params\": {%s}, "
+	       "\"ops\": %" G_GINT64_FORMAT ", \"ns_per_op\": %.1f",
+	       bench, params ? params : "", ops, (gdouble) ns / MAX(ops, 1));
+
+	if (bytes > 0)
+		printf(", \"mb_per_s\": %.1f", (bytes / 1048576.0) / (ns / 1e9));
+
+	printf("}\n");
+	fflush(stdout);
+}
+
+/* Keep everything the benchmark writes, config and database
+   included, away from the user's own */
+static inline gchar *
+hashfs_bench_tmpdir (void)
+{
+	gchar *dir;
+
+	dir = g_build_filename(g_get_tmp_dir(), "hashfs-bench-XXXXXX", NULL);
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Unable to create %s\n", dir);
+		exit(1);
+	}
+
+	g_setenv("XDG_CONFIG_HOME", dir, TRUE);
+
+	return dir;
+}
+
+static inline void
+hashfs_bench_rmdir (const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fullpath;
+
+	if ((dir = g_dir_open(path, 0, NULL))) {
+		while ((name = g_dir_read_name(dir))) {
+			fullpath = g_build_filename(path, name, NULL);
+
+			if (g_file_test(fullpath, G_FILE_TEST_IS_DIR))
+				hashfs_bench_rmdir(fullpath);
+			else
+				g_remove(fullpath);
+
+			g_free(fullpath);
+		}
+
+		g_dir_close(dir);
+	}
+
+	g_rmdir(path);
+}
+
+#endif
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include <glib.h>
+
+#include "hashfs.h"
+#include "bench.h"
+
+/* Records per anime in the generated library */
+#define EPISODES 26
+
+typedef struct {
+	const gchar *name;
+	const gchar *format;
+} hashfs_bench_query_t;
+
+static hashfs_bench_query_t queries[] = {
+	{ "Equals",     "anidb:aid.Equals(%d)" },
+	{ "BeginsWith", "basename.BeginsWith([Group] Series %d - )" },
+	{ "Contains",   "path.Contains(/Series %d/)" },
+};
+
+static gchar *
+hashfs_bench_path (gint i)
+{
+	return g_strdup_printf("/media/anime/Series %d/[Group] Series %d - %02d.mkv",
+	                       i / EPISODES, i / EPISODES, (i % EPISODES) + 1);
+}
+
+/* A library of records shaped like the ones hashfs update writes */
+static gchar **
+hashfs_bench_generate (gint records)
+{
+	hashfs_db_entry_t *entry;
+	gchar **keys, *path, *val;
+	gint64 start, elapsed;
+
+	keys = g_new0(gchar *, records + 1);
+
+	start = hashfs_bench_now();
+
+	hashfs_db_tran_begin();
+
+	for (gint i = 0; i < records; i++) {
+		path = hashfs_bench_path(i);
+		entry = hashfs_db_entry_new("file", path, NULL, NULL);
+
+		hashfs_db_entry_set(entry, "path", path);
+		hashfs_db_entry_set(entry, "basename", hashfs_basename(path));
+
+		val = g_strdup_printf("%d", 200000000 + i);
+		hashfs_db_entry_set(entry, "size", val);
+		g_free(val);
+
+		val = hashfs_md5_str(path);
+		hashfs_db_entry_set(entry, "hashfs:ed2k", val);
+		g_free(val);
+
+		val = g_strdup_printf("%d", i / EPISODES);
+		hashfs_db_entry_set(entry, "anidb:aid", val);
+		g_free(val);
+
+		hashfs_db_entry_put(entry);
+
+		keys[i] = g_strdup(hashfs_db_entry_pkey(entry));
+
+		hashfs_db_entry_destroy(entry);
+		g_free(path);
+	}
+
+	hashfs_db_tran_flush();
+
+	elapsed = hashfs_bench_now() - start;
+
+	val = g_strdup_printf("\"records\": %d", records);
+	hashfs_bench_report("db_insert", val, records, elapsed, 0);
+	g_free(val);
+
+	return keys;
+}
+
+static void
+hashfs_bench_entry_new (gchar **keys, gint records)
+{
+	hashfs_db_entry_t *entry;
+	gint64 start, elapsed, ops = 0;
+	gchar *params;
+
+	start = hashfs_bench_now();
+
+	do {
+		entry = hashfs_db_entry_new_from_key(keys[g_random_int_range(0, records)]);
+		hashfs_db_entry_destroy(entry);
+
+		ops++;
+		elapsed = hashfs_bench_now() - start;
+	} while (elapsed < HASHFS_BENCH_NS);
+
+	params = g_strdup_printf("\"records\": %d", records);
+	hashfs_bench_report("db_entry_new_from_key", params, ops, elapsed, 0);
+	g_free(params);
+}
+
+static void
+hashfs_bench_query (hashfs_bench_query_t *query, gint records)
+{
+	hashfs_db_query_t *q;
+	hashfs_db_result_t *result;
+	gint64 start, elapsed, ops = 0, found = 0;
+	gchar *querystr, *params;
+
+	start = hashfs_bench_now();
+
+	do {
+		querystr = g_strdup_printf(query->format, g_random_int_range(0, MAX(records / EPISODES, 1)));
+
+		q = hashfs_db_query_new(querystr);
+		result = hashfs_db_query_result(q);
+		found += hashfs_db_result_num(result);
+
+		hashfs_db_result_destroy(result);
+		hashfs_db_query_destroy(q);
+		g_free(querystr);
+
+		ops++;
+		elapsed = hashfs_bench_now() - start;
+	} while (elapsed < HASHFS_BENCH_NS);
+
+	params = g_strdup_printf("\"records\": %d, \"cond\": \"%s\", \"hits\": %.1f",
+	                         records, query->name, (gdouble) found / ops);
+	hashfs_bench_report("db_query", params, ops, elapsed, 0);
+	g_free(params);
+}
+
+static void
+hashfs_bench_format (gchar **keys)
+{
+	hashfs_db_entry_t *entry;
+	gint64 start, elapsed, ops = 0;
+	gchar *str;
+
+	entry = hashfs_db_entry_new_from_key(keys[0]);
+
+	start = hashfs_bench_now();
+
+	do {
+		str = hashfs_db_entry_format(entry, "$basename ($size bytes) $path");
+		g_free(str);
+
+		ops++;
+		elapsed = hashfs_bench_now() - start;
+	} while (elapsed < HASHFS_BENCH_NS);
+
+	hashfs_bench_report("db_entry_format", NULL, ops, elapsed, 0);
+
+	hashfs_db_entry_destroy(entry);
+}
+
+static void
+hashfs_bench_run (const gchar *dir, gint records, gboolean format)
+{
+	gchar *path, **keys;
+
+	if (!hashfs_db_init(FALSE)) {
+		fprintf(stderr, "Unable to open database in %s\n", dir);
+		exit(1);
+	}
+
+	keys = hashfs_bench_generate(records);
+
+	hashfs_bench_entry_new(keys, records);
+
+	for (gint q = 0; q < G_N_ELEMENTS(queries); q++)
+		hashfs_bench_query(&queries[q], records);
+
+	if (format)
+		hashfs_bench_format(keys);
+
+	g_strfreev(keys);
+
+	hashfs_db_destroy();
+
+	/* Start over with an empty database for the next size */
+	path = g_build_filename(dir, "hashfs", "metadata.tct", NULL);
+	g_remove(path);
+	g_free(path);
+}
+
+/* hashfs_dbbench [RECORDS ...] */
+gint
+main (gint argc, gchar **argv)
+{
+	gint counts[] = { 1000, 10000, 100000 };
+	gchar *dir;
+
+	dir = hashfs_bench_tmpdir();
+
+	hashfs_config_init();
+
+	if (argc > 1) {
+		for (gint i = 1; i < argc; i++)
+			hashfs_bench_run(dir, MAX(atoi(argv[i]), 1), i == 1);
+	} else {
+		for (gint i = 0; i < G_N_ELEMENTS(counts); i++)
+			hashfs_bench_run(dir, counts[i], i == 0);
+	}
+
+	hashfs_config_destroy();
+	hashfs_bench_rmdir(dir);
+
+	g_free(dir);
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+#include "bench.h"
+
+static const gchar *kernels[] = { "scalar", "sse2", "avx2", "avx512" };
+static const gchar *engines[] = { "sync", "io_uring", "af_alg" };
+
+/* MD4 kernels on buffers already in memory, one buffer per lane */
+static void
+hashfs_bench_md4 (void)
+{
+	const guchar *data[HASHFS_MD4_MAX_LANES];
+	gsize len[HASHFS_MD4_MAX_LANES];
+	guchar digests[HASHFS_MD4_MAX_LANES][16], *out[HASHFS_MD4_MAX_LANES];
+	guchar *buf;
+	gint64 start, elapsed, ops;
+	gsize size = 1024 * 1024;
+	gchar *params;
+	gint lanes;
+
+	buf = g_malloc(size);
+
+	for (gsize i = 0; i < size; i++)
+		buf[i] = i * 7;
+
+	for (gint i = 0; i < HASHFS_MD4_MAX_LANES; i++) {
+		data[i] = buf;
+		len[i] = size;
+		out[i] = digests[i];
+	}
+
+	for (gint k = 0; k < G_N_ELEMENTS(kernels); k++) {
+		if (!hashfs_md4_set_kernel(kernels[k]))
+			continue;
+
+		lanes = hashfs_md4_lanes();
+		ops = 0;
+		start = hashfs_bench_now();
+
+		do {
+			hashfs_md4_multi(data, len, out, lanes);
+
+			ops++;
+			elapsed = hashfs_bench_now() - start;
+		} while (elapsed < HASHFS_BENCH_NS);
+
+		params = g_strdup_printf("\"kernel\": \"%s\", \"lanes\": %d", kernels[k], lanes);
+		hashfs_bench_report("md4", params, ops, elapsed, ops * lanes * size);
+		g_free(params);
+	}
+
+	hashfs_md4_set_kernel(NULL);
+
+	g_free(buf);
+}
+
+static gchar *
+hashfs_bench_create_file (const gchar *dir, gint mib)
+{
+	GRand *rand;
+	guint32 *buf;
+	gchar *name, *path;
+	gsize len = 1024 * 1024;
+	FILE *file;
+
+	name = g_strdup_printf("data-%d", mib);
+	path = g_build_filename(dir, name, NULL);
+
+	rand = g_rand_new_with_seed(mib);
+	buf = g_malloc(len);
+	file = g_fopen(path, "wb");
+
+	for (gint i = 0; i < mib; i++) {
+		for (gsize j = 0; j < len / sizeof(guint32); j++)
+			buf[j] = g_rand_int(rand);
+
+		fwrite(buf, 1, len, file);
+	}
+
+	fflush(file);
+	fdatasync(fileno(file));
+	fclose(file);
+
+	g_rand_free(rand);
+	g_free(buf);
+	g_free(name);
+
+	return path;
+}
+
+static void
+hashfs_bench_drop_cache (const gchar *path)
+{
+	gint fd;
+
+	if ((fd = g_open(path, O_RDONLY, 0)) >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void
+hashfs_bench_hash_once (const gchar *path, gint64 size, gint types)
+{
+	hashfs_file_t *file;
+
+	file = g_new0(hashfs_file_t, 1);
+	file->filename = (gchar *) path;
+	file->size = size;
+
+	if (!hashfs_file_hash(file, types)) {
+		fprintf(stderr, "Failed to hash %s\n", path);
+		exit(1);
+	}
+
+	g_free(file->ed2k);
+	g_free(file->md5);
+	g_free(file->sha1);
+	g_free(file->crc32);
+	g_free(file->block_hashes);
+	g_free(file);
+}
+
+/* Whole files through the reader and digest engine. Cold runs drop
+   the file from the page cache first, which is as close to reading
+   from disk as we get without root */
+static void
+hashfs_bench_file (const gchar *path, gint mib, const gchar *engine, gint types,
+            gboolean cold)
+{
+	gint64 start, elapsed = 0, ops = 0;
+	gint64 size = (gint64) mib * 1024 * 1024;
+	gchar *params;
+
+	/* af_alg replaces reading altogether, for ed2k alone */
+	if (!g_strcmp0(engine, "af_alg")) {
+		hashfs_config_property_set("hashfs", "io_engine", "sync");
+		hashfs_config_property_set("hashfs", "ed2k_engine", "af_alg");
+	} else {
+		hashfs_config_property_set("hashfs", "io_engine", engine);
+		hashfs_config_property_set("hashfs", "ed2k_engine", "user");
+	}
+
+	hashfs_hash_init();
+
+	if (!g_strcmp0(engine, "af_alg") && (!hashfs_ed2k_offload() || types != HASHFS_HASH_ED2K)) {
+		hashfs_hash_destroy();
+
+		return;
+	}
+
+	if (!cold)
+		hashfs_bench_hash_once(path, size, types);
+
+	do {
+		if (cold)
+			hashfs_bench_drop_cache(path);
+
+		start = hashfs_bench_now();
+		hashfs_bench_hash_once(path, size, types);
+		elapsed += hashfs_bench_now() - start;
+
+		ops++;
+	} while (elapsed < HASHFS_BENCH_NS);
+
+	hashfs_hash_destroy();
+
+	params = g_strdup_printf("\"mib\": %d, \"engine\": \"%s\", \"digests\": \"%s\", \"cache\": \"%s\"",
+	                         mib, engine, types == HASHFS_HASH_ED2K ? "ed2k" : "all",
+	                         cold ? "cold" : "warm");
+	hashfs_bench_report("file_hash", params, ops, elapsed, ops * size);
+	g_free(params);
+}
+
+/* hashfs_ed2kbench [MiB ...] */
+gint
+main (gint argc, gchar **argv)
+{
+	gint sizes[] = { 1, 16, 256 };
+	gint all = HASHFS_HASH_ED2K | HASHFS_HASH_MD5 | HASHFS_HASH_SHA1 | HASHFS_HASH_CRC32;
+	gint *mib, nsizes;
+	gchar *dir, *path;
+
+	dir = hashfs_bench_tmpdir();
+
+	hashfs_config_init();
+
+	if (argc > 1) {
+		nsizes = argc - 1;
+		mib = g_new0(gint, nsizes);
+
+		for (gint i = 0; i < nsizes; i++)
+			mib[i] = MAX(atoi(argv[i + 1]), 1);
+	} else {
+		nsizes = G_N_ELEMENTS(sizes);
+		mib = g_memdup(sizes, sizeof(sizes));
+	}
+
+	hashfs_bench_md4();
+
+	for (gint i = 0; i < nsizes; i++) {
+		path = hashfs_bench_create_file(dir, mib[i]);
+
+		for (gint e = 0; e < G_N_ELEMENTS(engines); e++) {
+			hashfs_bench_file(path, mib[i], engines[e], HASHFS_HASH_ED2K, FALSE);
+			hashfs_bench_file(path, mib[i], engines[e], HASHFS_HASH_ED2K, TRUE);
+			hashfs_bench_file(path, mib[i], engines[e], all, FALSE);
+		}
+
+		g_remove(path);
+		g_free(path);
+	}
+
+	hashfs_config_destroy();
+	hashfs_bench_rmdir(dir);
+
+	g_free(mib);
+	g_free(dir);
+
+	return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+#define BUFFER_ALIGN 4096
+
+/* Block buffers are allocated once and recycled. Taking a buffer
+   blocks while all of them are in use, which bounds how far reading
+   can run ahead of hashing */
+static struct {
+	GMutex lock;
+	GCond cond;
+	GSList *free;
+	gint allocated;
+	gint max;
+} buffers;
+
+
+void
+hashfs_block_pool_init (gint max)
+{
+	g_mutex_init(&buffers.lock);
+	g_cond_init(&buffers.cond);
+
+	buffers.free = NULL;
+	buffers.allocated = 0;
+	buffers.max = max;
+
+	HASHFS_DEBUG("Using up to %d block buffers", max);
+}
+
+void
+hashfs_block_pool_destroy (void)
+{
+	GSList *item;
+
+	for (item = buffers.free; item; item = g_slist_next(item))
+		free(item->data);
+
+	g_slist_free(buffers.free);
+
+	g_mutex_clear(&buffers.lock);
+	g_cond_clear(&buffers.cond);
+
+	buffers.free = NULL;
+	buffers.allocated = 0;
+	buffers.max = 0;
+}
+
+gint
+hashfs_block_pool_size (void)
+{
+	return buffers.max;
+}
+
+static guchar *
+hashfs_block_buffer_get (gboolean wait)
+{
+	gpointer buf = NULL;
+
+	/* No pool, allocate per block */
+	if (buffers.max == 0) {
+		if (posix_memalign(&buf, BUFFER_ALIGN, HASHFS_ED2K_BLOCKSIZE) != 0)
+			return NULL;
+
+		return buf;
+	}
+
+	g_mutex_lock(&buffers.lock);
+
+	while (wait && !buffers.free && buffers.allocated >= buffers.max)
+		g_cond_wait(&buffers.cond, &buffers.lock);
+
+	if (buffers.free) {
+		buf = buffers.free->data;
+		buffers.free = g_slist_delete_link(buffers.free, buffers.free);
+	} else if (buffers.allocated < buffers.max &&
+	           posix_memalign(&buf, BUFFER_ALIGN, HASHFS_ED2K_BLOCKSIZE) == 0) {
+		buffers.allocated++;
+	} else {
+		buf = NULL;
+	}
+
+	g_mutex_unlock(&buffers.lock);
+
+	return buf;
+}
+
+static void
+hashfs_block_buffer_put (guchar *buf)
+{
+	if (buffers.max == 0) {
+		free(buf);
+
+		return;
+	}
+
+	g_mutex_lock(&buffers.lock);
+
+	buffers.free = g_slist_prepend(buffers.free, buf);
+	g_cond_signal(&buffers.cond);
+
+	g_mutex_unlock(&buffers.lock);
+}
+
+static hashfs_block_t *
+hashfs_block_alloc (gint index, gint64 offset, gsize len, gboolean wait)
+{
+	hashfs_block_t *block;
+	guchar *data;
+
+	g_return_val_if_fail(len <= HASHFS_ED2K_BLOCKSIZE, NULL);
+
+	if (!(data = hashfs_block_buffer_get(wait)))
+		return NULL;
+
+	block = g_new0(hashfs_block_t, 1);
+	block->index = index;
+	block->offset = offset;
+	block->len = len;
+	block->data = data;
+	block->refcount = 1;
+
+	return block;
+}
+
+hashfs_block_t *
+hashfs_block_new (gint index, gint64 offset, gsize len)
+{
+	hashfs_block_t *block;
+
+	if (!(block = hashfs_block_alloc(index, offset, len, TRUE)))
+		HASHFS_DEBUG("Failed to allocate buffer for block %d", index);
+
+	return block;
+}
+
+/* Like hashfs_block_new(), but returns NULL instead of
+   waiting when every buffer is in use */
+hashfs_block_t *
+hashfs_block_try_new (gint index, gint64 offset, gsize len)
+{
+	return hashfs_block_alloc(index, offset, len, FALSE);
+}
+
+/* A block of a hole in a sparse file. It takes no buffer, its data
+   is one run of zeros shared by all of them */
+hashfs_block_t *
+hashfs_block_zero (gint index, gint64 offset, gsize len)
+{
+	static gsize once = 0;
+	static guchar *zeros;
+	hashfs_block_t *block;
+
+	g_return_val_if_fail(len <= HASHFS_ED2K_BLOCKSIZE, NULL);
+
+	/* Large enough for calloc to map it, so it costs no memory */
+	if (g_once_init_enter(&once)) {
+		zeros = g_malloc0(HASHFS_ED2K_BLOCKSIZE);
+		g_once_init_leave(&once, 1);
+	}
+
+	block = g_new0(hashfs_block_t, 1);
+	block->index = index;
+	block->offset = offset;
+	block->len = len;
+	block->data = zeros;
+	block->zero = TRUE;
+	block->refcount = 1;
+
+	return block;
+}
+
+hashfs_block_t *
+hashfs_block_ref (hashfs_block_t *block)
+{
+	g_atomic_int_inc(&block->refcount);
+
+	return block;
+}
+
+void
+hashfs_block_unref (hashfs_block_t *block)
+{
+	if (g_atomic_int_dec_and_test(&block->refcount)) {
+		if (!block->zero)
+			hashfs_block_buffer_put(block->data);
+
+		g_free(block);
+	}
+}
@@ -28,6 +28,27 @@ hashfs_config_property_set (const gchar *group, const gchar *key, const gchar *v
 	g_key_file_set_string(config, group, key, value);
 }
 
+void
+hashfs_config_property_register (const gchar *group, const gchar *key, const gchar *defaultval)
+{
+	if (!hashfs_config_property_exists(group, key))
+		hashfs_config_property_set(group, key, defaultval);
+}
+
+gint
+hashfs_config_property_lookup_int (const gchar *group, const gchar *key)
+{
+	gchar *val;
+	gint rval;
+
+	hashfs_config_property_lookup(group, key, &val);
+	rval = val ? atoi(val) : 0;
+
+	g_free(val);
+
+	return rval;
+}
+
 GKeyFile *
 hashfs_config_keyfile (void)
 {
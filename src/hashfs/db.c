@@ -41,6 +41,20 @@ hashfs_db_init (gboolean readonly)
 	db->path = path;
 	db->flags = flags;
 
+	g_mutex_init(&db->tran_lock);
+
+	if (!readonly) {
+		/* hashfs update looks files up and stores them on a thread
+		   of its own */
+		tctdbsetmutex(db->tdb);
+
+		hashfs_config_property_register("hashfs", "commit_files", "256");
+		hashfs_config_property_register("hashfs", "commit_ms", "2000");
+
+		db->commit_files = hashfs_config_property_lookup_int("hashfs", "commit_files");
+		db->commit_ms = hashfs_config_property_lookup_int("hashfs", "commit_ms");
+	}
+
 	if (!tctdbopen(db->tdb, path, flags)) {
 		HASHFS_DEBUG("Unable to open DB: %s", hashfs_db_error());
 
@@ -51,12 +65,32 @@ hashfs_db_init (gboolean readonly)
 		rval = TRUE;
 	}
 
+	if (rval && !readonly) {
+		/* Looked up for every file hashed, to find copies of it.
+		   Without an index each lookup reads the whole table */
+		tctdbsetindex(db->tdb, "hashfs:quick", TDBITLEXICAL | TDBITKEEP);
+
+		/* Looked up for every file without an entry, to find
+		   where it was moved from */
+		tctdbsetindex(db->tdb, "hashfs:stat", TDBITLEXICAL | TDBITKEEP);
+
+		/* Looked up for every new file hashed, to find where it
+		   was moved from on another filesystem */
+		tctdbsetindex(db->tdb, "hashfs:ed2k", TDBITLEXICAL | TDBITKEEP);
+	}
+
 	return rval;
 }
 
+/* Readers pick up whatever was committed since they opened. The
+   writer has nothing to catch up on, and closing it would write its
+   header and drop an open transaction */
 static void
 hashfs_db_reload (void)
 {
+	if (db->flags & TDBOWRITER)
+		return;
+
 	tctdbclose(db->tdb);
 	tctdbopen(db->tdb, db->path, db->flags);
 }
@@ -66,6 +100,8 @@ hashfs_db_destroy (void)
 {
 	g_return_if_fail(db != NULL);
 
+	hashfs_db_tran_flush();
+
 	if (!tctdbclose(db->tdb)) {
 		HASHFS_DEBUG("Unable to close DB: %s", hashfs_db_error());
 	} else {
@@ -74,32 +110,116 @@ hashfs_db_destroy (void)
 
 	tctdbdel(db->tdb);
 
+	g_mutex_clear(&db->tran_lock);
 	g_free(db->path);
 	free(db);
+
+	db = NULL;
 }
 
+static gboolean
+hashfs_db_tran_open (void)
+{
+	if (db->tran)
+		return TRUE;
+
+	HASHFS_DEBUG("Starting transsaction");
+
+	if (!tctdbtranbegin(db->tdb))
+		return FALSE;
+
+	db->tran = TRUE;
+	db->tran_files = 0;
+	db->tran_start = g_get_monotonic_time();
+
+	return TRUE;
+}
+
+static gboolean
+hashfs_db_tran_close (void)
+{
+	if (!db->tran)
+		return TRUE;
+
+	HASHFS_DEBUG("Comitting transsaction of %d files", db->tran_files);
+
+	db->tran = FALSE;
+
+	return (gboolean) tctdbtrancommit(db->tdb);
+}
+
+static gint
+hashfs_db_tran_left (void)
+{
+	gint64 elapsed;
+
+	if (!db->tran)
+		return -1;
+
+	elapsed = (g_get_monotonic_time() - db->tran_start) / 1000;
+
+	return (gint) MAX(db->commit_ms - elapsed, 0);
+}
+
+/* Files share one transaction until hashfs.commit_files of them have
+   gone into it or it has been open for hashfs.commit_ms, so the table
+   is synced once per batch rather than once per file. A crash loses
+   at most that much */
 gboolean
 hashfs_db_tran_begin (void)
 {
-	HASHFS_DEBUG("Starting transsaction");
+	gboolean rval;
+
+	g_mutex_lock(&db->tran_lock);
+	rval = hashfs_db_tran_open();
+	g_mutex_unlock(&db->tran_lock);
 
-	return (gboolean) tctdbtranbegin(db->tdb);
+	return rval;
 }
 
 gboolean
 hashfs_db_tran_commit (void)
 {
-	HASHFS_DEBUG("Comitting transsaction");
+	gboolean rval = TRUE;
 
-	return (gboolean) tctdbtrancommit(db->tdb);
+	g_mutex_lock(&db->tran_lock);
+
+	if (db->tran && (++db->tran_files >= db->commit_files || hashfs_db_tran_left() == 0))
+		rval = hashfs_db_tran_close();
+
+	g_mutex_unlock(&db->tran_lock);
+
+	return rval;
 }
 
+/* Commit the open transaction now, whatever is left of its batch */
 gboolean
-hashfs_db_tran_abort (void)
+hashfs_db_tran_flush (void)
+{
+	gboolean rval;
+
+	g_mutex_lock(&db->tran_lock);
+	rval = hashfs_db_tran_close();
+	g_mutex_unlock(&db->tran_lock);
+
+	return rval;
+}
+
+/* Milliseconds until the open transaction has to be committed, -1
+   when there is none */
+gint
+hashfs_db_tran_due (void)
 {
-	HASHFS_DEBUG("Aborting transsaction");
+	gint rval;
+
+	if (!db)
+		return -1;
+
+	g_mutex_lock(&db->tran_lock);
+	rval = hashfs_db_tran_left();
+	g_mutex_unlock(&db->tran_lock);
 
-	return (gboolean) tctdbtranabort(db->tdb);
+	return rval;
 }
 
 gchar *
@@ -110,9 +230,9 @@ hashfs_db_error (void)
 	return (gchar *) tctdberrmsg(ecode);
 }
 
-hashfs_db_entry_t *
-hashfs_db_entry_new (const gchar *prefix, const gchar *id,
-                     const gchar *source, const gchar *type)
+static gchar *
+hashfs_db_pkey (const gchar *prefix, const gchar *id,
+                const gchar *source, const gchar *type)
 {
 	gchar *pkey, *md5;
 
@@ -125,7 +245,21 @@ hashfs_db_entry_new (const gchar *prefix, const gchar *id,
 
 	g_free(md5);
 
-	return hashfs_db_entry_new_from_key(pkey);
+	return pkey;
+}
+
+hashfs_db_entry_t *
+hashfs_db_entry_new (const gchar *prefix, const gchar *id,
+                     const gchar *source, const gchar *type)
+{
+	hashfs_db_entry_t *entry;
+	gchar *pkey;
+
+	pkey = hashfs_db_pkey(prefix, id, source, type);
+	entry = hashfs_db_entry_new_from_key(pkey);
+	g_free(pkey);
+
+	return entry;
 }
 
 hashfs_db_entry_t *
@@ -160,6 +294,40 @@ hashfs_db_entry_set (hashfs_db_entry_t *entry, const gchar *key,
 	tcmapput2(entry->data, key, value);
 }
 
+/* Copy the columns of from that entry has no value for */
+void
+hashfs_db_entry_fill (hashfs_db_entry_t *entry, hashfs_db_entry_t *from)
+{
+	const gchar *key, *val, *cur;
+
+	g_return_if_fail(entry != NULL);
+	g_return_if_fail(from != NULL);
+
+	tcmapiterinit(from->data);
+
+	while ((key = tcmapiternext2(from->data))) {
+		val = tcmapget2(from->data, key);
+		cur = tcmapget2(entry->data, key);
+
+		if (val && *val && (!cur || !*cur))
+			tcmapput2(entry->data, key, val);
+	}
+}
+
+void
+hashfs_db_entry_foreach (hashfs_db_entry_t *entry, hashfs_db_entry_func func,
+                         gpointer data)
+{
+	const gchar *key;
+
+	g_return_if_fail(entry != NULL);
+
+	tcmapiterinit(entry->data);
+
+	while ((key = tcmapiternext2(entry->data)))
+		func(key, tcmapget2(entry->data, key), data);
+}
+
 gboolean
 hashfs_db_entry_lookup (hashfs_db_entry_t *entry, const gchar *key,
                         const gchar **out)
@@ -226,12 +394,78 @@ hashfs_db_entry_pkey (hashfs_db_entry_t *entry)
 gboolean
 hashfs_db_entry_put (hashfs_db_entry_t *entry)
 {
+	gboolean rval;
+
 	g_return_val_if_fail(entry != NULL, FALSE);
 	g_return_val_if_fail(entry->pkey != NULL, FALSE);
 	g_return_val_if_fail(entry->data != NULL, FALSE);
 
-	return (gboolean) tctdbputcat(db->tdb, entry->pkey, strlen(entry->pkey),
+	g_mutex_lock(&db->tran_lock);
+
+	/* Another thread may have committed the batch the file started
+	   in, its writes go into the next one */
+	if (db->flags & TDBOWRITER)
+		hashfs_db_tran_open();
+
+	rval = (gboolean) tctdbputcat(db->tdb, entry->pkey, strlen(entry->pkey),
 	                              entry->data);
+
+	g_mutex_unlock(&db->tran_lock);
+
+	return rval;
+}
+
+gboolean
+hashfs_db_entry_remove (hashfs_db_entry_t *entry)
+{
+	gboolean rval;
+
+	g_return_val_if_fail(entry != NULL, FALSE);
+	g_return_val_if_fail(entry->pkey != NULL, FALSE);
+
+	g_mutex_lock(&db->tran_lock);
+
+	if (db->flags & TDBOWRITER)
+		hashfs_db_tran_open();
+
+	rval = (gboolean) tctdbout2(db->tdb, entry->pkey);
+
+	g_mutex_unlock(&db->tran_lock);
+
+	return rval;
+}
+
+/* Store entry under the key of id instead of its own, replacing
+   whatever was there. Both happen in the same batch */
+gboolean
+hashfs_db_entry_move (hashfs_db_entry_t *entry, const gchar *prefix,
+                      const gchar *id)
+{
+	gchar *pkey;
+	gboolean rval;
+
+	g_return_val_if_fail(entry != NULL, FALSE);
+	g_return_val_if_fail(entry->pkey != NULL, FALSE);
+	g_return_val_if_fail(entry->data != NULL, FALSE);
+
+	pkey = hashfs_db_pkey(prefix, id, NULL, NULL);
+
+	g_mutex_lock(&db->tran_lock);
+
+	if (db->flags & TDBOWRITER)
+		hashfs_db_tran_open();
+
+	rval = (gboolean) tctdbput(db->tdb, pkey, strlen(pkey), entry->data);
+
+	if (rval && g_strcmp0(pkey, entry->pkey) != 0)
+		tctdbout2(db->tdb, entry->pkey);
+
+	g_mutex_unlock(&db->tran_lock);
+
+	g_free(entry->pkey);
+	entry->pkey = pkey;
+
+	return rval;
 }
 
 void
@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "hashfs.h"
+
+typedef struct hashfs_digest_St {
+	gint types;
+
+	hashfs_ed2k_t *ed2k;
+	MD5_CTX md5;
+	SHA_CTX sha1;
+	uLong crc32;
+} hashfs_digest_t;
+
+/* Blocks between ed2k checkpoints */
+static gint checkpoint;
+
+/* Configured reads in flight per file */
+static gint io_depth;
+
+/* Bytes sampled from each part of a file for its quick fingerprint */
+static gint64 quick;
+
+
+void
+hashfs_hash_init (void)
+{
+	gint threads, buffers, depth;
+	gchar *kernel, *engine;
+	gboolean drop;
+
+	hashfs_config_property_register("hashfs", "threads", "0");
+	hashfs_config_property_register("hashfs", "md4_kernel", "auto");
+	hashfs_config_property_register("hashfs", "read_buffers", "0");
+	hashfs_config_property_register("hashfs", "drop_cache", "1");
+	hashfs_config_property_register("hashfs", "io_engine", "auto");
+	hashfs_config_property_register("hashfs", "io_depth", "4");
+	hashfs_config_property_register("hashfs", "ed2k_engine", "user");
+	hashfs_config_property_register("hashfs", "checkpoint", "1024");
+	hashfs_config_property_register("hashfs", "streams_rotational", "1");
+	hashfs_config_property_register("hashfs", "streams_solid", "4");
+	hashfs_config_property_register("hashfs", "hash_order", "size");
+	hashfs_config_property_register("hashfs", "hash_window", "256");
+	hashfs_config_property_register("hashfs", "quick_mib", "4");
+	hashfs_config_property_register("hashfs", "walk_threads", "8");
+	hashfs_config_property_register("hashfs", "lookup_queue", "256");
+	hashfs_config_property_register("hashfs", "watch_settle_ms", "3000");
+	hashfs_config_property_register("hashfs", "prune_threads", "16");
+
+	threads = hashfs_config_property_lookup_int("hashfs", "threads");
+
+	/* 0 means one thread per CPU */
+	if (threads <= 0)
+		threads = g_get_num_processors();
+
+	HASHFS_DEBUG("Using %d hashing threads", threads);
+
+	hashfs_config_property_lookup("hashfs", "md4_kernel", &kernel);
+
+	if (!hashfs_md4_set_kernel(kernel)) {
+		HASHFS_LOG("MD4 kernel %s is not supported, using auto", kernel);
+		hashfs_md4_set_kernel(NULL);
+	}
+
+	g_free(kernel);
+
+	/* Each buffer holds one ed2k block, 0 picks a few per thread */
+	buffers = hashfs_config_property_lookup_int("hashfs", "read_buffers");
+
+	if (buffers <= 0)
+		buffers = CLAMP(threads * 4, 8, 32);
+
+	buffers = MAX(buffers, 2);
+
+	hashfs_block_pool_init(buffers);
+
+	/* Reads in flight per file, leaving most buffers for hashing */
+	io_depth = hashfs_config_property_lookup_int("hashfs", "io_depth");
+	depth = CLAMP(io_depth, 1, MAX(buffers / 4, 1));
+
+	drop = hashfs_config_property_lookup_int("hashfs", "drop_cache") > 0;
+
+	hashfs_config_property_lookup("hashfs", "io_engine", &engine);
+	hashfs_readers_init(drop, engine, depth);
+	g_free(engine);
+
+	/* MiB hashed between ed2k checkpoints, 0 turns them off */
+	checkpoint = hashfs_config_property_lookup_int("hashfs", "checkpoint");
+	checkpoint = checkpoint > 0 ? MAX((gint64) checkpoint * 1024 * 1024 / HASHFS_ED2K_BLOCKSIZE, 1) : 0;
+	hashfs_ed2k_init(threads);
+
+	/* MiB read from each end and the middle to spot copies, 0 = off */
+	quick = (gint64) MAX(hashfs_config_property_lookup_int("hashfs", "quick_mib"), 0) * 1024 * 1024;
+
+	hashfs_config_property_lookup("hashfs", "ed2k_engine", &engine);
+
+	if (!hashfs_ed2k_set_engine(engine, drop)) {
+		HASHFS_LOG("ed2k engine %s is not available, using user", engine);
+		hashfs_ed2k_set_engine("user", drop);
+	}
+
+	g_free(engine);
+}
+
+void
+hashfs_hash_destroy (void)
+{
+	hashfs_ed2k_destroy();
+	hashfs_readers_destroy();
+	hashfs_block_pool_destroy();
+}
+
+/* Split the buffer pool between files hashed at the same time, so
+   their half filled ed2k batches and reads in flight can never take
+   every buffer. Returns how many streams the pool can feed */
+gint
+hashfs_hash_streams (gint streams)
+{
+	gint buffers = hashfs_block_pool_size();
+
+	streams = CLAMP(streams, 1, MAX(buffers / 4, 1));
+
+	hashfs_readers_set_depth(CLAMP(io_depth, 1, MAX(buffers / (4 * streams), 1)));
+	hashfs_ed2k_set_streams(streams);
+
+	return streams;
+}
+
+
+static void
+hashfs_digest_init (hashfs_digest_t *digest, gint types, gint64 size)
+{
+	digest->types = types;
+
+	if (types & HASHFS_HASH_ED2K)
+		digest->ed2k = hashfs_ed2k_new(size);
+
+	if (types & HASHFS_HASH_MD5)
+		MD5_Init(&digest->md5);
+
+	if (types & HASHFS_HASH_SHA1)
+		SHA1_Init(&digest->sha1);
+
+	if (types & HASHFS_HASH_CRC32)
+		digest->crc32 = crc32(0L, Z_NULL, 0);
+}
+
+/* Feed the same block to every requested digest. ed2k blocks are
+   handed to the worker pool, the rest are hashed in order here */
+static void
+hashfs_digest_update (hashfs_digest_t *digest, hashfs_block_t *block)
+{
+	if (digest->types & HASHFS_HASH_ED2K)
+		hashfs_ed2k_update(digest->ed2k, block);
+
+	if (digest->types & HASHFS_HASH_MD5)
+		MD5_Update(&digest->md5, block->data, block->len);
+
+	if (digest->types & HASHFS_HASH_SHA1)
+		SHA1_Update(&digest->sha1, block->data, block->len);
+
+	if (digest->types & HASHFS_HASH_CRC32)
+		digest->crc32 = crc32(digest->crc32, block->data, block->len);
+}
+
+static void
+hashfs_digest_final (hashfs_digest_t *digest, hashfs_file_t *file,
+                     gboolean complete)
+{
+	guchar md[SHA_DIGEST_LENGTH];
+
+	if (digest->types & HASHFS_HASH_ED2K) {
+		gint blocks = hashfs_ed2k_blocks(file->size);
+
+		/* Keep the block digests for hashfs verify, a single
+		   block's digest is the ed2k hash itself */
+		if (complete && blocks > 1) {
+			hashfs_ed2k_sync(digest->ed2k);
+			hashfs_file_block_hashes_set(file, hashfs_ed2k_block_hashes(digest->ed2k), blocks);
+		}
+
+		hashfs_ed2k_final(digest->ed2k, complete ? &file->ed2k : NULL);
+	}
+
+	if (!complete)
+		return;
+
+	if (digest->types & HASHFS_HASH_MD5) {
+		MD5_Final(md, &digest->md5);
+		file->md5 = hashfs_hex_str(md, MD5_DIGEST_LENGTH);
+	}
+
+	if (digest->types & HASHFS_HASH_SHA1) {
+		SHA1_Final(md, &digest->sha1);
+		file->sha1 = hashfs_hex_str(md, SHA_DIGEST_LENGTH);
+	}
+
+	if (digest->types & HASHFS_HASH_CRC32)
+		file->crc32 = g_strdup_printf("%08lx", digest->crc32);
+}
+
+/* Save the ed2k progress of a file hashed up to block index */
+static gboolean
+hashfs_digest_checkpoint (hashfs_digest_t *digest, hashfs_file_t *file, gint index)
+{
+	if (!hashfs_ed2k_sync(digest->ed2k))
+		return FALSE;
+
+	hashfs_file_checkpoint(file, hashfs_ed2k_block_hashes(digest->ed2k), index);
+
+	return TRUE;
+}
+
+/* Write a block to the same offset of out, holes are left alone */
+static gboolean
+hashfs_digest_write (hashfs_block_t *block, gint out)
+{
+	gsize done = 0;
+	ssize_t n;
+
+	if (block->zero)
+		return TRUE;
+
+	while (done < block->len) {
+		n = pwrite(out, block->data + done, block->len - done, block->offset + done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return FALSE;
+
+		done += n;
+	}
+
+	return TRUE;
+}
+
+/* Read the file from block index on through the block buffers, and
+   copy every block to out unless it's -1 */
+static gboolean
+hashfs_digest_read (hashfs_digest_t *digest, hashfs_file_t *file, gint index,
+                    gboolean resumable, gint out)
+{
+	hashfs_reader_t *reader;
+	hashfs_block_t *block;
+	gint next_checkpoint;
+	gboolean complete, written = TRUE;
+
+	if (!(reader = hashfs_reader_new(file->filename, file->size)))
+		return FALSE;
+
+	if (index > 0)
+		hashfs_reader_seek(reader, index);
+
+	next_checkpoint = index + checkpoint;
+
+	while ((block = hashfs_reader_next(reader))) {
+		hashfs_digest_update(digest, block);
+
+		if (out >= 0 && !hashfs_digest_write(block, out)) {
+			HASHFS_DEBUG("Failed to write copy of file (%s): %s", file->filename, g_strerror(errno));
+			hashfs_block_unref(block);
+
+			written = FALSE;
+			break;
+		}
+
+		if (resumable && block->index + 1 >= next_checkpoint) {
+			hashfs_digest_checkpoint(digest, file, block->index + 1);
+
+			next_checkpoint = block->index + 1 + checkpoint;
+		}
+
+		hashfs_block_unref(block);
+	}
+
+	complete = written && !hashfs_reader_failed(reader);
+	hashfs_reader_destroy(reader);
+
+	return complete;
+}
+
+/* ed2k alone, with every block handed to the kernel's md4 straight
+   from the page cache */
+static gboolean
+hashfs_digest_offload (hashfs_digest_t *digest, hashfs_file_t *file, gint index,
+                       gboolean resumable)
+{
+	gint fd, blocks, next_checkpoint;
+	gboolean complete = TRUE;
+
+	if ((fd = g_open(file->filename, O_RDONLY, 0)) < 0) {
+		HASHFS_DEBUG("Failed to open file (%s): %s", file->filename, g_strerror(errno));
+
+		return FALSE;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	blocks = hashfs_ed2k_blocks(file->size);
+	next_checkpoint = index + checkpoint;
+
+	for (; index < blocks && complete; index++) {
+		hashfs_ed2k_update_fd(digest->ed2k, fd, index);
+
+		if (resumable && index + 1 >= next_checkpoint) {
+			complete = hashfs_digest_checkpoint(digest, file, index + 1);
+
+			next_checkpoint = index + 1 + checkpoint;
+		}
+	}
+
+	/* The blocks still queued read from fd */
+	if (!hashfs_ed2k_sync(digest->ed2k))
+		complete = FALSE;
+
+	close(fd);
+
+	return complete;
+}
+
+/* The digests in types the file has no value for yet */
+gint
+hashfs_file_missing (hashfs_file_t *file, gint types)
+{
+	if (file->ed2k)
+		types &= ~HASHFS_HASH_ED2K;
+
+	if (file->md5)
+		types &= ~HASHFS_HASH_MD5;
+
+	if (file->sha1)
+		types &= ~HASHFS_HASH_SHA1;
+
+	if (file->crc32)
+		types &= ~HASHFS_HASH_CRC32;
+
+	return types;
+}
+
+/* Compute every digest in types that the file doesn't already have,
+   reading the file only once. Large files hashed for ed2k alone are
+   checkpointed every so many blocks, and resumed from there */
+gboolean
+hashfs_file_hash (hashfs_file_t *file, gint types)
+{
+	hashfs_digest_t digest = { 0 };
+	gboolean complete, resumable;
+	guchar *hashes;
+	gint resumed = 0;
+
+	if ((types = hashfs_file_missing(file, types)) == 0)
+		return TRUE;
+
+	if (file->size < 1)
+		return FALSE;
+
+	hashfs_digest_init(&digest, types, file->size);
+
+	/* The other digests can't be picked up half way */
+	resumable = types == HASHFS_HASH_ED2K && checkpoint > 0 &&
+	            hashfs_ed2k_blocks(file->size) > checkpoint;
+
+	if (resumable && (resumed = hashfs_file_checkpoint_load(file, &hashes)) > 0) {
+		hashfs_ed2k_resume(digest.ed2k, hashes, resumed);
+
+		g_free(hashes);
+	}
+
+	if (types == HASHFS_HASH_ED2K && hashfs_ed2k_offload())
+		complete = hashfs_digest_offload(&digest, file, resumed, resumable);
+	else
+		complete = hashfs_digest_read(&digest, file, resumed, resumable, -1);
+
+	hashfs_digest_final(&digest, file, complete);
+
+	if (complete)
+		hashfs_file_cache_store(file);
+	else
+		HASHFS_DEBUG("Failed to hash file (%s)", file->filename);
+
+	return complete;
+}
+
+/* Let the kernel copy the whole file to out, FALSE if it can't copy
+   between these two filesystems or the C library has no
+   copy_file_range */
+static gboolean
+hashfs_digest_clone (hashfs_file_t *file, gint out)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t in_off = 0, out_off = 0;
+	ssize_t n = 0;
+	gint fd;
+
+	if ((fd = g_open(file->filename, O_RDONLY, 0)) < 0)
+		return FALSE;
+
+	while (in_off < file->size) {
+		n = copy_file_range(fd, &in_off, out, &out_off, MIN(file->size - in_off, G_MAXINT32), 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+	}
+
+	if (n < 0)
+		HASHFS_DEBUG("Unable to copy file (%s) in the kernel: %s", file->filename, g_strerror(errno));
+
+	close(fd);
+
+	return in_off == file->size;
+#else
+	return FALSE;
+#endif
+}
+
+/* Copy the file to dest, which must not exist yet, computing every
+   digest in types it lacks from the blocks as they are copied. When
+   no digest is missing the kernel copies it without it passing
+   through here. On success the file describes the copy */
+gboolean
+hashfs_file_copy (hashfs_file_t *file, const gchar *dest, gint types)
+{
+	hashfs_digest_t digest = { 0 };
+	struct timespec times[2];
+	struct stat info;
+	gboolean complete;
+	gint out;
+
+	if (g_stat(file->filename, &info) != 0)
+		return FALSE;
+
+	if ((out = g_open(dest, O_WRONLY | O_CREAT | O_EXCL, info.st_mode & 0777)) < 0) {
+		HASHFS_DEBUG("Failed to create file (%s): %s", dest, g_strerror(errno));
+
+		return FALSE;
+	}
+
+	types = hashfs_file_missing(file, types);
+
+	if (file->size < 1 || (types == 0 && hashfs_digest_clone(file, out))) {
+		complete = TRUE;
+	} else {
+		hashfs_digest_init(&digest, types, file->size);
+		complete = hashfs_digest_read(&digest, file, 0, FALSE, out);
+		hashfs_digest_final(&digest, file, complete);
+	}
+
+	/* Covers a hole at the end, and keeps the time it was made */
+	times[0] = info.st_atim;
+	times[1] = info.st_mtim;
+
+	if (complete && (ftruncate(out, file->size) != 0 || futimens(out, times) != 0))
+		complete = FALSE;
+
+	if (close(out) != 0)
+		complete = FALSE;
+
+	if (!complete || g_stat(dest, &info) != 0) {
+		HASHFS_DEBUG("Failed to copy file (%s) to %s", file->filename, dest);
+		g_unlink(dest);
+
+		return FALSE;
+	}
+
+	g_free(file->filename);
+	g_free(file->fingerprint);
+
+	file->filename = g_strdup(dest);
+	file->fingerprint = hashfs_file_fingerprint(&info);
+
+	return TRUE;
+}
+
+/* Hash len bytes from offset into ctx, in pieces the size of buf */
+static gboolean
+hashfs_digest_sample (MD5_CTX *ctx, gint fd, gint64 offset, gint64 len,
+                      guchar *buf, gsize size)
+{
+	ssize_t got;
+
+	while (len > 0) {
+		got = pread(fd, buf, MIN((gint64) size, len), offset);
+
+		if (got <= 0)
+			return FALSE;
+
+		MD5_Update(ctx, buf, got);
+
+		offset += got;
+		len -= got;
+	}
+
+	return TRUE;
+}
+
+/* Size and an MD5 over the head, middle and tail of a file, enough
+   to tell a copy of a file we already hashed from anything else
+   before reading all of it. NULL for files small enough to just
+   hash, and for ones with holes, which are usually unfinished
+   downloads whose samples can match the finished file. Compressed
+   files take fewer blocks as well, only SEEK_HOLE tells them apart */
+gchar *
+hashfs_file_quick (const gchar *filename, struct stat *info)
+{
+	MD5_CTX ctx;
+	guchar md[MD5_DIGEST_LENGTH], *buf;
+	gint64 size = info->st_size, len;
+	gsize bufsize = 1024 * 1024;
+	gboolean complete;
+	gchar *hex, *rval;
+	off_t hole;
+	gint fd;
+
+	if (quick <= 0 || size <= quick * 4 * 3)
+		return NULL;
+
+	if ((fd = g_open(filename, O_RDONLY, 0)) < 0)
+		return NULL;
+
+	/* Filesystems that can't tell put the only hole at the end */
+	if ((hole = lseek(fd, 0, SEEK_HOLE)) >= 0 && hole < size) {
+		close(fd);
+
+		return NULL;
+	}
+
+	buf = g_malloc(bufsize);
+	len = quick;
+
+	MD5_Init(&ctx);
+
+	complete = hashfs_digest_sample(&ctx, fd, 0, len, buf, bufsize) &&
+	           hashfs_digest_sample(&ctx, fd, (size - len) / 2, len, buf, bufsize) &&
+	           hashfs_digest_sample(&ctx, fd, size - len, len, buf, bufsize);
+
+	MD5_Final(md, &ctx);
+
+	g_free(buf);
+	close(fd);
+
+	if (!complete)
+		return NULL;
+
+	hex = hashfs_hex_str(md, MD5_DIGEST_LENGTH);
+	rval = g_strdup_printf("%" G_GINT64_FORMAT ":%s", size, hex);
+	g_free(hex);
+
+	return rval;
+}
+
+gboolean
+hashfs_file_hash_ed2k (hashfs_file_t *file, const gchar **out)
+{
+	if (!hashfs_file_hash(file, HASHFS_HASH_ED2K))
+		return FALSE;
+
+	*out = file->ed2k;
+
+	return TRUE;
+}
+
+gboolean
+hashfs_file_hash_md5 (hashfs_file_t *file, const gchar **out)
+{
+	if (!hashfs_file_hash(file, HASHFS_HASH_MD5))
+		return FALSE;
+
+	*out = file->md5;
+
+	return TRUE;
+}
+
+gboolean
+hashfs_file_hash_sha1 (hashfs_file_t *file, const gchar **out)
+{
+	if (!hashfs_file_hash(file, HASHFS_HASH_SHA1))
+		return FALSE;
+
+	*out = file->sha1;
+
+	return TRUE;
+}
+
+gboolean
+hashfs_file_hash_crc32 (hashfs_file_t *file, const gchar **out)
+{
+	if (!hashfs_file_hash(file, HASHFS_HASH_CRC32))
+		return FALSE;
+
+	*out = file->crc32;
+
+	return TRUE;
+}
@@ -0,0 +1,353 @@
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+/* Files with the same ed2k */
+typedef struct hashfs_dupes_group_St {
+	gchar *ed2k;
+	gint64 size;
+	GList *files;
+} hashfs_dupes_group_t;
+
+/* A file added, as the walker found it */
+typedef struct hashfs_dupes_file_St {
+	gchar *filename;
+	struct stat info;
+} hashfs_dupes_file_t;
+
+struct hashfs_dupes_St {
+	/* Every file added, by size */
+	GHashTable *sizes;
+
+	/* Hard links to a file already added aren't copies of it */
+	GHashTable *inodes;
+
+	/* Candidates by ed2k, filled in as they are hashed */
+	GHashTable *groups;
+
+	gint files;
+};
+
+
+static void
+hashfs_dupes_group_free (gpointer data)
+{
+	hashfs_dupes_group_t *group = data;
+
+	g_free(group->ed2k);
+	g_list_free_full(group->files, g_free);
+	g_free(group);
+}
+
+static void
+hashfs_dupes_file_free (gpointer data)
+{
+	hashfs_dupes_file_t *file = data;
+
+	g_free(file->filename);
+	g_free(file);
+}
+
+static void
+hashfs_dupes_list_free (gpointer data)
+{
+	g_list_free_full(data, hashfs_dupes_file_free);
+}
+
+static gint
+hashfs_dupes_group_cmp (gconstpointer a, gconstpointer b)
+{
+	const hashfs_dupes_group_t *ga = a, *gb = b;
+
+	if (ga->size == gb->size)
+		return g_strcmp0(ga->ed2k, gb->ed2k);
+
+	return ga->size < gb->size ? 1 : -1;
+}
+
+/* Finds files with the same content. Only files whose size matches
+   another one are ever hashed */
+hashfs_dupes_t *
+hashfs_dupes_new (void)
+{
+	hashfs_dupes_t *dupes;
+
+	dupes = g_new0(hashfs_dupes_t, 1);
+	dupes->sizes = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, hashfs_dupes_list_free);
+	dupes->inodes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	dupes->groups = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, hashfs_dupes_group_free);
+
+	return dupes;
+}
+
+void
+hashfs_dupes_add (hashfs_dupes_t *dupes, const gchar *filename, struct stat *info)
+{
+	hashfs_dupes_file_t *file;
+	gint64 *size;
+	GList *files;
+	gchar *inode;
+
+	if (!S_ISREG(info->st_mode) || info->st_size < 1)
+		return;
+
+	inode = g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+	                        (guint64) info->st_dev, (guint64) info->st_ino);
+
+	if (g_hash_table_lookup_extended(dupes->inodes, inode, NULL, NULL)) {
+		HASHFS_DEBUG("File (%s) is a link to one already added", filename);
+		g_free(inode);
+
+		return;
+	}
+
+	g_hash_table_insert(dupes->inodes, inode, NULL);
+
+	file = g_new(hashfs_dupes_file_t, 1);
+	file->filename = g_strdup(filename);
+	file->info = *info;
+
+	size = g_new(gint64, 1);
+	*size = info->st_size;
+
+	files = g_hash_table_lookup(dupes->sizes, size);
+
+	/* Appending leaves the head the table holds where it is */
+	if (files) {
+		files = g_list_append(files, file);
+		g_free(size);
+	} else {
+		g_hash_table_insert(dupes->sizes, size, g_list_append(NULL, file));
+	}
+
+	dupes->files++;
+}
+
+/* Store the ed2k of a candidate, and drop it from a group it was in
+   on an earlier run until its group is found again */
+static void
+hashfs_dupes_hashed (hashfs_file_t *hashed, gpointer data)
+{
+	hashfs_dupes_t *dupes = data;
+	hashfs_dupes_group_t *group;
+	hashfs_file_t *file;
+	const gchar *val;
+
+	file = hashfs_file_new(hashed->filename, NULL);
+	hashfs_file_adopt(file, hashed);
+
+	if (hashfs_file_prop_lookup(file, "hashfs:dupes", &val) && *val)
+		hashfs_file_prop_set(file, "hashfs:dupes", "");
+
+	if (file->ed2k) {
+		if (!(group = g_hash_table_lookup(dupes->groups, file->ed2k))) {
+			group = g_new0(hashfs_dupes_group_t, 1);
+			group->ed2k = g_strdup(file->ed2k);
+			group->size = file->size;
+
+			g_hash_table_insert(dupes->groups, group->ed2k, group);
+		}
+
+		group->files = g_list_prepend(group->files, g_strdup(file->filename));
+	} else {
+		HASHFS_DEBUG("Failed to hash file (%s)", file->filename);
+	}
+
+	hashfs_file_destroy(file);
+}
+
+/* A file whose size no other one has, it is nobody's copy any more
+   if it was on an earlier run */
+static void
+hashfs_dupes_leave (const gchar *filename)
+{
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+
+	entry = hashfs_db_entry_new("file", filename, NULL, NULL);
+
+	if (hashfs_db_entry_lookup(entry, "hashfs:dupes", &val) && *val) {
+		hashfs_db_entry_set(entry, "hashfs:dupes", "");
+		hashfs_db_entry_put(entry);
+		hashfs_db_tran_commit();
+	}
+
+	hashfs_db_entry_destroy(entry);
+}
+
+/* Put every file of a group in the hashfs:dupes set named after
+   their ed2k */
+static void
+hashfs_dupes_store (hashfs_dupes_group_t *group)
+{
+	hashfs_file_t *file;
+	hashfs_set_t *set;
+	GList *item;
+	gchar *val;
+
+	for (item = group->files; item; item = g_list_next(item)) {
+		file = hashfs_file_new(item->data, NULL);
+		set = hashfs_file_add_to_set(file, group->ed2k, "hashfs:dupes");
+
+		hashfs_set_prop_set(set, "ed2k", group->ed2k);
+
+		val = g_strdup_printf("%" G_GINT64_FORMAT, group->size);
+		hashfs_set_prop_set(set, "size", val);
+		g_free(val);
+
+		val = g_strdup_printf("%u", g_list_length(group->files));
+		hashfs_set_prop_set(set, "files", val);
+		g_free(val);
+
+		hashfs_file_destroy(file);
+	}
+}
+
+/* Drop the hashfs:dupes sets no file is in any more, and count the
+   files of the rest again. Some may be in paths not given this time */
+static void
+hashfs_dupes_sets (void)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	GHashTable *counts;
+	const gchar *val;
+	gchar *files;
+	gint count;
+
+	hashfs_db_tran_flush();
+
+	counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	query = hashfs_db_query_new("hashfs:dupes.BeginsWith(set:)");
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result); i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+
+		if (hashfs_db_entry_lookup(entry, "hashfs:dupes", &val)) {
+			count = GPOINTER_TO_INT(g_hash_table_lookup(counts, val));
+			g_hash_table_replace(counts, g_strdup(val), GINT_TO_POINTER(count + 1));
+		}
+
+		hashfs_db_entry_destroy(entry);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+
+	query = hashfs_db_query_new("pkey.BeginsWith(set:hashfs:hashfs:dupes:)");
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result); i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+		count = GPOINTER_TO_INT(g_hash_table_lookup(counts, hashfs_db_entry_pkey(entry)));
+
+		if (count == 0) {
+			HASHFS_DEBUG("Set (%s) no longer used", hashfs_db_entry_pkey(entry));
+			hashfs_db_entry_remove(entry);
+		} else {
+			files = g_strdup_printf("%d", count);
+
+			if (!hashfs_db_entry_lookup(entry, "files", &val) || g_strcmp0(val, files)) {
+				hashfs_db_entry_set(entry, "files", files);
+				hashfs_db_entry_put(entry);
+			}
+
+			g_free(files);
+		}
+
+		hashfs_db_entry_destroy(entry);
+		hashfs_db_tran_commit();
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+
+	g_hash_table_destroy(counts);
+}
+
+/* Hash the files that share their size with another one, store the
+   groups with the same ed2k and call func for each of them, biggest
+   files first */
+void
+hashfs_dupes_run (hashfs_dupes_t *dupes, hashfs_dupes_func func, gpointer data)
+{
+	hashfs_dupes_group_t *group;
+	hashfs_dupes_file_t *file;
+	hashfs_sched_t *sched;
+	GHashTableIter iter;
+	GList *files, *groups = NULL, *item;
+	gpointer value;
+	gint candidates = 0;
+
+	sched = hashfs_sched_new();
+
+	/* A quick fingerprint match is no proof of two files being the
+	   same, every candidate needs its own ed2k */
+	hashfs_sched_set_copies(sched, FALSE);
+
+	g_hash_table_iter_init(&iter, dupes->sizes);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		files = value;
+
+		if (!g_list_next(files)) {
+			file = files->data;
+			hashfs_dupes_leave(file->filename);
+
+			continue;
+		}
+
+		for (item = files; item; item = g_list_next(item)) {
+			file = item->data;
+			hashfs_sched_add(sched, file->filename, &file->info, HASHFS_HASH_ED2K);
+			candidates++;
+		}
+	}
+
+	HASHFS_LOG("%d of %d files have the size of another one", candidates, dupes->files);
+
+	hashfs_sched_close(sched);
+	hashfs_sched_run(sched, hashfs_dupes_hashed, dupes);
+	hashfs_sched_destroy(sched);
+
+	g_hash_table_iter_init(&iter, dupes->groups);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		group = value;
+
+		if (g_list_next(group->files)) {
+			group->files = g_list_sort(group->files, (GCompareFunc) g_strcmp0);
+			groups = g_list_prepend(groups, group);
+		}
+	}
+
+	groups = g_list_sort(groups, hashfs_dupes_group_cmp);
+
+	for (item = groups; item; item = g_list_next(item)) {
+		group = item->data;
+
+		hashfs_dupes_store(group);
+
+		if (func)
+			func(group->ed2k, group->size, group->files, data);
+	}
+
+	g_list_free(groups);
+
+	hashfs_dupes_sets();
+}
+
+void
+hashfs_dupes_destroy (hashfs_dupes_t *dupes)
+{
+	g_hash_table_destroy(dupes->groups);
+	g_hash_table_destroy(dupes->inodes);
+	g_hash_table_destroy(dupes->sizes);
+
+	g_free(dupes);
+}
@@ -1,98 +1,611 @@
-#define _FILE_OFFSET_BITS 64
-#define _LARGEFILE_SOURCE 1
-#define _LARGEFILE64_SOURCE 1
-#define _LARGE_FILES 1
+#define _GNU_SOURCE
 
-#define BLOCKSIZE (9500*1024)
-
-#include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_AF_ALG
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#endif
 
-#include <openssl/md4.h>
 #include <glib.h>
-#include <glib/gstdio.h>
-#include <glib/gprintf.h>
 
 #include "hashfs.h"
 
+struct hashfs_ed2k_St {
+	gint64 size;
+	gint blocks;
+	guchar *hash_blocks;
+	gboolean failed;
 
-static const gchar hexdigits[16] = "0123456789abcdef";
+	/* Blocks waiting to fill every lane of the MD4 kernel */
+	hashfs_block_t *batch[HASHFS_MD4_MAX_LANES];
+	gint batched;
+	gint batch_size;
 
-gboolean
-hashfs_file_hash_ed2k (hashfs_file_t *file, const gchar **out)
+	gint pending;
+	GMutex lock;
+	GCond cond;
+};
+
+typedef struct hashfs_ed2k_job_St {
+	hashfs_ed2k_t *ed2k;
+	hashfs_block_t *blocks[HASHFS_MD4_MAX_LANES];
+	gint n;
+
+	/* Or a single block hashed straight from the file */
+	gint fd;
+	gint index;
+} hashfs_ed2k_job_t;
+
+/* Per thread state for hashing blocks from a file descriptor */
+typedef struct hashfs_ed2k_alg_St {
+	gint tfm;
+	gint op;
+	gint pipe[2];
+	gint pipe_size;
+
+	/* Userspace fallback */
+	guchar *buf;
+} hashfs_ed2k_alg_t;
+
+static void hashfs_ed2k_alg_free (gpointer data);
+
+
+static GThreadPool *pool;
+static gint threads = 1;
+
+/* Files being hashed at the same time */
+static gint streams = 1;
+
+/* Blocks spliced into the kernel's md4 rather than read */
+static gboolean offload;
+static gboolean drop_cache;
+
+static GPrivate alg_key = G_PRIVATE_INIT(hashfs_ed2k_alg_free);
+
+
+#ifdef HAVE_AF_ALG
+
+static gint
+hashfs_ed2k_alg_socket (void)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+		.salg_name = "md4",
+	};
+	gint fd;
+
+	if ((fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Forget a half hashed block, the next one starts over with a new
+   operation and an empty pipe */
+static void
+hashfs_ed2k_alg_reset (hashfs_ed2k_alg_t *alg)
 {
-	gint blocks, fd, len;
-	gint64 size, offset;
-	guchar *hash_blocks, *hash_final;
-	gchar *hash_str;
-	MD4_CTX ctx;
-	gpointer data;
+	if (alg->op >= 0)
+		close(alg->op);
 
-	if ((fd = g_open(file->filename, O_RDONLY, "rb")) < 0) {
-		HASHFS_DEBUG("Failed to open file (%s)", file->filename);
+	if (alg->pipe[0] >= 0) {
+		close(alg->pipe[0]);
+		close(alg->pipe[1]);
+	}
+
+	alg->op = alg->pipe[0] = alg->pipe[1] = -1;
+}
+
+static gboolean
+hashfs_ed2k_alg_open (hashfs_ed2k_alg_t *alg)
+{
+	if (alg->op >= 0)
+		return TRUE;
+
+	if (alg->tfm < 0 && (alg->tfm = hashfs_ed2k_alg_socket()) < 0)
+		return FALSE;
+
+	if ((alg->op = accept4(alg->tfm, NULL, 0, SOCK_CLOEXEC)) < 0 ||
+	    pipe2(alg->pipe, O_CLOEXEC) < 0) {
+		HASHFS_DEBUG("Unable to set up AF_ALG md4: %s", g_strerror(errno));
+
+		hashfs_ed2k_alg_reset(alg);
 
 		return FALSE;
 	}
 
-	blocks = file->size / BLOCKSIZE;
+	/* Fewer round trips with a bigger pipe, the default is 64 KiB */
+	fcntl(alg->pipe[1], F_SETPIPE_SZ, 1024 * 1024);
 
-	if ((file->size % BLOCKSIZE) > 0)
-		blocks++;
+	if ((alg->pipe_size = fcntl(alg->pipe[1], F_GETPIPE_SZ)) <= 0)
+		alg->pipe_size = 64 * 1024;
+
+	return TRUE;
+}
 
+/* Move the block from the page cache through a pipe into the md4
+   operation without copying it, then read back its digest. Every
+   splice is flagged as having more to come, even a short one of the
+   last chunk would end the digest otherwise. Reading it finishes it */
+static gboolean
+hashfs_ed2k_alg_splice (hashfs_ed2k_alg_t *alg, gint fd, gint64 offset,
+                        gsize len, guchar *out)
+{
+	loff_t off = offset;
+	gssize n, m;
 
-	if (blocks < 1)
+	if (!hashfs_ed2k_alg_open(alg))
 		return FALSE;
 
+	while (len > 0) {
+		if ((n = splice(fd, &off, alg->pipe[1], NULL, MIN(len, alg->pipe_size), SPLICE_F_MOVE)) <= 0)
+			return FALSE;
 
-	hash_blocks = g_malloc(blocks * 16);
-	hash_str = g_strnfill(33, 0);
-	offset = 0;
+		len -= n;
 
-	g_return_val_if_fail(hash_blocks != NULL, 0);
-	g_return_val_if_fail(hash_str != NULL, 0);
+		for (; n > 0; n -= m) {
+			m = splice(alg->pipe[0], NULL, alg->op, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
 
-	for (gint b = 0; b < blocks; b++) {
-		len = (blocks - b) == 1 ? file->size % BLOCKSIZE : BLOCKSIZE;
-		data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+			if (m <= 0)
+				return FALSE;
+		}
+	}
 
-		g_return_val_if_fail(data != NULL, 0);
+	return read(alg->op, out, 16) == 16;
+}
 
-		MD4_Init(&ctx);
-		MD4_Update(&ctx, data, len);
-		MD4_Final(hash_blocks + (b * 16), &ctx);
+#endif
 
-		munmap(data, len);
+static hashfs_ed2k_alg_t *
+hashfs_ed2k_alg_get (void)
+{
+	hashfs_ed2k_alg_t *alg;
 
-		offset += len;
+	if ((alg = g_private_get(&alg_key)) == NULL) {
+		alg = g_new0(hashfs_ed2k_alg_t, 1);
+		alg->tfm = alg->op = alg->pipe[0] = alg->pipe[1] = -1;
+
+		g_private_set(&alg_key, alg);
 	}
 
-	close(fd);
+	return alg;
+}
 
-	/* If we have hashed more than one block,
-	   run MD4 on all the previous hashes */
-	if (blocks > 1) {
-		hash_final = g_malloc(16);
+static void
+hashfs_ed2k_alg_free (gpointer data)
+{
+	hashfs_ed2k_alg_t *alg = data;
 
-		MD4_Init(&ctx);
-		MD4_Update(&ctx, hash_blocks, 16 * blocks);
-		MD4_Final(hash_final, &ctx);
-	} else {
-		hash_final = g_memdup(hash_blocks, 16);
+#ifdef HAVE_AF_ALG
+	hashfs_ed2k_alg_reset(alg);
+
+	if (alg->tfm >= 0)
+		close(alg->tfm);
+#endif
+
+	g_free(alg->buf);
+	g_free(alg);
+}
+
+/* The digest of a hole, the same for every full block */
+static void
+hashfs_ed2k_hash_zero (hashfs_block_t *block, guchar *out)
+{
+	static gsize once = 0;
+	static guchar full[16];
+
+	if (block->len < HASHFS_ED2K_BLOCKSIZE) {
+		hashfs_md4(block->data, block->len, out);
+
+		return;
 	}
 
-	/* Convert hash to hex string format */
-	for (gint i = 0; i < 16; i++) {
-		hash_str[(i<<1)] = hexdigits[(((hash_final[i]) & 0xf0) >> 4)];
-		hash_str[(i<<1)+1] = hexdigits[(((hash_final[i]) & 0x0f))];
+	if (g_once_init_enter(&once)) {
+		hashfs_md4(block->data, HASHFS_ED2K_BLOCKSIZE, full);
+		g_once_init_leave(&once, 1);
 	}
 
-	g_free(hash_blocks);
-	g_free(hash_final);
+	memcpy(out, full, 16);
+}
 
-	file->ed2k = hash_str;
-	*out = hash_str;
+/* TRUE if the block at offset has no data, only a hole */
+static gboolean
+hashfs_ed2k_hole (gint fd, gint64 offset, gsize len)
+{
+	off_t data;
+
+	if ((data = lseek(fd, offset, SEEK_DATA)) < 0)
+		return errno == ENXIO;
+
+	return data >= offset + (gint64) len;
+}
+
+static gboolean
+hashfs_ed2k_pread (gint fd, guchar *buf, gsize len, gint64 offset)
+{
+	gssize n;
+
+	while (len > 0) {
+		if ((n = pread(fd, buf, len, offset)) < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return FALSE;
+
+		buf += n;
+		len -= n;
+		offset += n;
+	}
 
 	return TRUE;
 }
+
+/* Hash one block of fd, in the kernel when it can be spliced there
+   and with our own MD4 when it can't */
+static void
+hashfs_ed2k_hash_fd (hashfs_ed2k_t *ed2k, gint fd, gint index)
+{
+	hashfs_ed2k_alg_t *alg;
+	gint64 offset;
+	guchar *out;
+	gsize len;
+
+	offset = (gint64) index * HASHFS_ED2K_BLOCKSIZE;
+	len = MIN(HASHFS_ED2K_BLOCKSIZE, ed2k->size - offset);
+	out = ed2k->hash_blocks + (index * 16);
+
+	if (hashfs_ed2k_hole(fd, offset, len)) {
+		hashfs_block_t *block = hashfs_block_zero(index, offset, len);
+
+		hashfs_ed2k_hash_zero(block, out);
+		hashfs_block_unref(block);
+
+		return;
+	}
+
+	alg = hashfs_ed2k_alg_get();
+
+#ifdef HAVE_AF_ALG
+	if (hashfs_ed2k_alg_splice(alg, fd, offset, len, out))
+		goto done;
+
+	HASHFS_DEBUG("Unable to splice block %d, hashing it in userspace", index);
+
+	hashfs_ed2k_alg_reset(alg);
+#endif
+
+	if (!alg->buf)
+		alg->buf = g_malloc(HASHFS_ED2K_BLOCKSIZE);
+
+	if (hashfs_ed2k_pread(fd, alg->buf, len, offset)) {
+		hashfs_md4(alg->buf, len, out);
+	} else {
+		HASHFS_DEBUG("Failed to read block %d", index);
+
+		g_mutex_lock(&ed2k->lock);
+		ed2k->failed = TRUE;
+		g_mutex_unlock(&ed2k->lock);
+	}
+
+#ifdef HAVE_AF_ALG
+done:
+#endif
+	if (drop_cache)
+		posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+
+/* Hash up to one kernel's worth of blocks in lockstep, then drop them */
+static void
+hashfs_ed2k_hash_blocks (hashfs_ed2k_t *ed2k, hashfs_block_t **blocks, gint n)
+{
+	const guchar *data[HASHFS_MD4_MAX_LANES];
+	gsize len[HASHFS_MD4_MAX_LANES];
+	guchar *out[HASHFS_MD4_MAX_LANES];
+
+	for (gint i = 0; i < n; i++) {
+		data[i] = blocks[i]->data;
+		len[i] = blocks[i]->len;
+		out[i] = ed2k->hash_blocks + (blocks[i]->index * 16);
+	}
+
+	hashfs_md4_multi(data, len, out, n);
+
+	for (gint i = 0; i < n; i++)
+		hashfs_block_unref(blocks[i]);
+}
+
+static void
+hashfs_ed2k_worker (gpointer data, gpointer user_data)
+{
+	hashfs_ed2k_job_t *job = data;
+	hashfs_ed2k_t *ed2k = job->ed2k;
+
+	if (job->n > 0)
+		hashfs_ed2k_hash_blocks(ed2k, job->blocks, job->n);
+	else
+		hashfs_ed2k_hash_fd(ed2k, job->fd, job->index);
+
+	g_mutex_lock(&ed2k->lock);
+
+	/* Wakes up both sync and update_fd waiting for a free slot */
+	ed2k->pending--;
+	g_cond_signal(&ed2k->cond);
+
+	g_mutex_unlock(&ed2k->lock);
+
+	g_free(job);
+}
+
+/* Hash the batched blocks, on the worker pool if there is one */
+static void
+hashfs_ed2k_flush (hashfs_ed2k_t *ed2k)
+{
+	if (ed2k->batched == 0)
+		return;
+
+	if (pool) {
+		hashfs_ed2k_job_t *job;
+
+		g_mutex_lock(&ed2k->lock);
+		ed2k->pending++;
+		g_mutex_unlock(&ed2k->lock);
+
+		job = g_new0(hashfs_ed2k_job_t, 1);
+		job->ed2k = ed2k;
+		job->n = ed2k->batched;
+		memcpy(job->blocks, ed2k->batch, sizeof(hashfs_block_t *) * job->n);
+
+		g_thread_pool_push(pool, job, NULL);
+	} else {
+		hashfs_ed2k_hash_blocks(ed2k, ed2k->batch, ed2k->batched);
+	}
+
+	ed2k->batched = 0;
+}
+
+void
+hashfs_ed2k_init (gint nthreads)
+{
+	g_return_if_fail(pool == NULL);
+
+	threads = MAX(nthreads, 1);
+
+	if (threads > 1)
+		pool = g_thread_pool_new(hashfs_ed2k_worker, NULL, threads, TRUE, NULL);
+}
+
+void
+hashfs_ed2k_destroy (void)
+{
+	if (pool) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+		pool = NULL;
+	}
+
+	threads = 1;
+	streams = 1;
+	offload = FALSE;
+
+	g_private_replace(&alg_key, NULL);
+}
+
+/* "user" reads blocks into buffers and hashes them with our own MD4,
+   "af_alg" splices them into the kernel's md4 instead. Returns FALSE
+   if the engine isn't available */
+gboolean
+hashfs_ed2k_set_engine (const gchar *name, gboolean dropcache)
+{
+	drop_cache = dropcache;
+	offload = FALSE;
+
+	if (name == NULL || !g_strcmp0(name, "user"))
+		return TRUE;
+
+	if (g_strcmp0(name, "af_alg") != 0)
+		return FALSE;
+
+#ifdef HAVE_AF_ALG
+	{
+		gint fd;
+
+		if ((fd = hashfs_ed2k_alg_socket()) < 0) {
+			HASHFS_DEBUG("Kernel md4 not available: %s", g_strerror(errno));
+
+			return FALSE;
+		}
+
+		close(fd);
+		offload = TRUE;
+
+		HASHFS_DEBUG("Hashing ed2k blocks with the kernel's md4");
+
+		return TRUE;
+	}
+#else
+	return FALSE;
+#endif
+}
+
+gboolean
+hashfs_ed2k_offload (void)
+{
+	return offload;
+}
+
+/* Share the buffer pool between this many files hashed at once */
+void
+hashfs_ed2k_set_streams (gint nstreams)
+{
+	streams = MAX(nstreams, 1);
+}
+
+gint
+hashfs_ed2k_blocks (gint64 size)
+{
+	gint blocks;
+
+	blocks = size / HASHFS_ED2K_BLOCKSIZE;
+
+	if ((size % HASHFS_ED2K_BLOCKSIZE) > 0)
+		blocks++;
+
+	return blocks;
+}
+
+hashfs_ed2k_t *
+hashfs_ed2k_new (gint64 size)
+{
+	hashfs_ed2k_t *ed2k;
+
+	ed2k = g_new0(hashfs_ed2k_t, 1);
+	ed2k->size = size;
+	ed2k->blocks = hashfs_ed2k_blocks(size);
+	ed2k->hash_blocks = g_malloc0(MAX(ed2k->blocks, 1) * 16);
+
+	/* Fill the MD4 lanes, but not at the cost of leaving threads
+	   idle on files with only a few blocks, or of holding on to so
+	   many buffers that the reader can't fill the next batch */
+	ed2k->batch_size = MIN(ed2k->blocks / threads, hashfs_md4_lanes());
+
+	if (hashfs_block_pool_size() > 0)
+		ed2k->batch_size = MIN(ed2k->batch_size, hashfs_block_pool_size() / (2 * streams));
+
+	ed2k->batch_size = MAX(ed2k->batch_size, 1);
+
+	g_mutex_init(&ed2k->lock);
+	g_cond_init(&ed2k->cond);
+
+	return ed2k;
+}
+
+/* Queue one block for hashing. The block is referenced until its
+   digest has been written to its slot */
+void
+hashfs_ed2k_update (hashfs_ed2k_t *ed2k, hashfs_block_t *block)
+{
+	g_return_if_fail(block->index < ed2k->blocks);
+
+	/* Holes hash the same every time, no need for a worker */
+	if (block->zero) {
+		hashfs_ed2k_hash_zero(block, ed2k->hash_blocks + (block->index * 16));
+
+		return;
+	}
+
+	ed2k->batch[ed2k->batched++] = hashfs_block_ref(block);
+
+	if (ed2k->batched >= ed2k->batch_size)
+		hashfs_ed2k_flush(ed2k);
+}
+
+/* Queue block index of fd to be hashed without going through the
+   block buffers. fd has to stay open until the next sync */
+void
+hashfs_ed2k_update_fd (hashfs_ed2k_t *ed2k, gint fd, gint index)
+{
+	hashfs_ed2k_job_t *job;
+
+	g_return_if_fail(index < ed2k->blocks);
+
+	if (!pool) {
+		hashfs_ed2k_hash_fd(ed2k, fd, index);
+
+		return;
+	}
+
+	/* A couple of blocks per thread is enough to keep them busy */
+	g_mutex_lock(&ed2k->lock);
+
+	while (ed2k->pending >= threads * 2)
+		g_cond_wait(&ed2k->cond, &ed2k->lock);
+
+	ed2k->pending++;
+	g_mutex_unlock(&ed2k->lock);
+
+	job = g_new0(hashfs_ed2k_job_t, 1);
+	job->ed2k = ed2k;
+	job->fd = fd;
+	job->index = index;
+
+	g_thread_pool_push(pool, job, NULL);
+}
+
+/* Take the digests of blocks hashed by an earlier, interrupted run */
+void
+hashfs_ed2k_resume (hashfs_ed2k_t *ed2k, const guchar *hashes, gint blocks)
+{
+	g_return_if_fail(blocks <= ed2k->blocks);
+
+	memcpy(ed2k->hash_blocks, hashes, blocks * 16);
+}
+
+/* Wait until every block queued so far has been hashed. Returns
+   FALSE if one of them couldn't be read */
+gboolean
+hashfs_ed2k_sync (hashfs_ed2k_t *ed2k)
+{
+	gboolean rval;
+
+	hashfs_ed2k_flush(ed2k);
+
+	g_mutex_lock(&ed2k->lock);
+
+	while (ed2k->pending > 0)
+		g_cond_wait(&ed2k->cond, &ed2k->lock);
+
+	rval = !ed2k->failed;
+
+	g_mutex_unlock(&ed2k->lock);
+
+	return rval;
+}
+
+/* 16 bytes per block, only valid up to the last sync */
+const guchar *
+hashfs_ed2k_block_hashes (hashfs_ed2k_t *ed2k)
+{
+	return ed2k->hash_blocks;
+}
+
+/* Wait for outstanding blocks, then join the block digests in order.
+   Pass NULL as out to throw away an incomplete hash */
+gboolean
+hashfs_ed2k_final (hashfs_ed2k_t *ed2k, gchar **out)
+{
+	guchar hash_final[16];
+
+	if (!hashfs_ed2k_sync(ed2k))
+		out = NULL;
+
+	if (out && ed2k->blocks > 0) {
+		/* If we have hashed more than one block,
+		   run MD4 on all the previous hashes */
+		if (ed2k->blocks > 1) {
+			hashfs_md4(ed2k->hash_blocks, 16 * ed2k->blocks, hash_final);
+		} else {
+			memcpy(hash_final, ed2k->hash_blocks, 16);
+		}
+
+		*out = hashfs_hex_str(hash_final, 16);
+	}
+
+	g_mutex_clear(&ed2k->lock);
+	g_cond_clear(&ed2k->cond);
+
+	g_free(ed2k->hash_blocks);
+	g_free(ed2k);
+
+	return out != NULL;
+}
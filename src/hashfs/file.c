@@ -1,31 +1,563 @@
+#include <sys/stat.h>
+
 #include <glib.h>
 
 #include "hashfs.h"
 
+#define LENGTH(x) sizeof(x)/sizeof(x[0])
+
+/* Digests cached in the file entry, valid as long as
+   hashfs:stat matches the file on disk */
+static const gchar *cache_keys[] = {
+	"hashfs:ed2k",
+	"hashfs:md5",
+	"hashfs:sha1",
+	"hashfs:crc32",
+	"hashfs:quick",
+};
+
+static gchar **
+hashfs_file_cache_field (hashfs_file_t *file, gint index)
+{
+	gchar **fields[] = { &file->ed2k, &file->md5, &file->sha1, &file->crc32, &file->quick };
+
+	return fields[index];
+}
+
+/* Device, inode, size and mtime, changes whenever the file is
+   written to or replaced */
+gchar *
+hashfs_file_fingerprint (struct stat *info)
+{
+	return g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld",
+	                       (guint64) info->st_dev, (guint64) info->st_ino,
+	                       (gint64) info->st_size, (gint64) info->st_mtim.tv_sec,
+	                       (glong) info->st_mtim.tv_nsec);
+}
+
+/* Digests stored while the file looked like fingerprint says it does
+   now, FALSE if the entry has none or they are stale */
+static gboolean
+hashfs_file_cache_read (hashfs_file_t *file, hashfs_db_entry_t *entry,
+                        const gchar *fingerprint)
+{
+	const gchar *val;
+
+	if (!hashfs_db_entry_lookup(entry, "hashfs:stat", &val) ||
+	    g_strcmp0(val, fingerprint) != 0)
+		return FALSE;
+
+	for (gint i = 0; i < LENGTH(cache_keys); i++) {
+		if (hashfs_db_entry_lookup(entry, cache_keys[i], &val) && *val)
+			*hashfs_file_cache_field(file, i) = g_strdup(val);
+	}
+
+	return TRUE;
+}
+
+/* Pick up the digests of an unchanged file, or invalidate them.
+   Entries are stored with tctdbputcat, so stale columns are blanked
+   rather than removed */
+static void
+hashfs_file_cache_load (hashfs_file_t *file, const gchar *fingerprint)
+{
+	const gchar *val;
+
+	if (hashfs_file_cache_read(file, file->entry, fingerprint)) {
+		HASHFS_DEBUG("File (%s) unchanged, using cached digests", hashfs_basename(file->filename));
+
+		return;
+	}
+
+	for (gint i = 0; i < LENGTH(cache_keys); i++) {
+		if (hashfs_db_entry_lookup(file->entry, cache_keys[i], &val))
+			hashfs_db_entry_set(file->entry, cache_keys[i], "");
+	}
+
+	if (hashfs_db_entry_lookup(file->entry, "hashfs:ed2k_blocks", &val))
+		hashfs_db_entry_set(file->entry, "hashfs:ed2k_blocks", "");
+
+	hashfs_db_entry_set(file->entry, "hashfs:stat", fingerprint);
+}
+
+/* Remember freshly computed digests for the next run */
+void
+hashfs_file_cache_store (hashfs_file_t *file)
+{
+	gchar *val;
+
+	if (!file->entry)
+		return;
+
+	for (gint i = 0; i < LENGTH(cache_keys); i++) {
+		if ((val = *hashfs_file_cache_field(file, i)))
+			hashfs_db_entry_set(file->entry, cache_keys[i], val);
+	}
+}
+
+/* Block digests saved by an interrupted run of an unchanged file,
+   returns how many blocks they cover */
+gint
+hashfs_file_checkpoint_load (hashfs_file_t *file, guchar **hashes)
+{
+	const gchar *val;
+	gsize len;
+
+	if (file->entry) {
+		if (!hashfs_db_entry_lookup(file->entry, "hashfs:ed2k_blocks", &val) || !*val)
+			return 0;
+
+		*hashes = g_base64_decode(val, &len);
+	} else if (file->block_hashes) {
+		len = file->block_count * 16;
+		*hashes = g_memdup(file->block_hashes, len);
+	} else {
+		return 0;
+	}
+
+	/* A full list belongs to a finished file */
+	if (len % 16 != 0 || len / 16 >= hashfs_ed2k_blocks(file->size)) {
+		g_free(*hashes);
+
+		return 0;
+	}
+
+	HASHFS_DEBUG("File (%s) resuming after block %d", hashfs_basename(file->filename), (gint) (len / 16));
+
+	return len / 16;
+}
+
+/* Store the MD4 digests of the first blocks, 16 bytes each. A
+   detached file keeps them until they are adopted */
+void
+hashfs_file_block_hashes_set (hashfs_file_t *file, const guchar *hashes, gint blocks)
+{
+	gchar *val;
+
+	if (!file->entry) {
+		g_free(file->block_hashes);
+
+		file->block_hashes = g_memdup(hashes, blocks * 16);
+		file->block_count = blocks;
+
+		return;
+	}
+
+	val = g_base64_encode(hashes, blocks * 16);
+	hashfs_db_entry_set(file->entry, "hashfs:ed2k_blocks", val);
+	g_free(val);
+}
+
+/* Save the digests of the first blocks and commit them right away,
+   so they survive the process being killed. Detached files hand them
+   to their checkpoint function instead */
+void
+hashfs_file_checkpoint (hashfs_file_t *file, const guchar *hashes, gint blocks)
+{
+	if (!file->entry) {
+		if (file->checkpoint_func)
+			file->checkpoint_func(file, hashes, blocks, file->checkpoint_data);
+
+		return;
+	}
+
+	hashfs_file_block_hashes_set(file, hashes, blocks);
+
+	hashfs_db_entry_put(file->entry);
+	hashfs_db_tran_flush();
+	hashfs_db_tran_begin();
+}
+
 hashfs_file_t *
 hashfs_file_new (const gchar *filename, hashfs_backend_t *backend)
 {
 	hashfs_file_t *file;
 	struct stat info;
+	gboolean found;
 
-	stat(filename, &info);
+	found = g_stat(filename, &info) == 0;
 
 	file = g_new0(hashfs_file_t, 1);
 	file->backend = backend;
 	file->entry = hashfs_db_entry_new("file", filename, NULL, NULL);
 	file->filename = g_strdup(filename);
-	file->size = (gint64) info.st_size;
+	file->size = found ? (gint64) info.st_size : 0;
 
 	file->ed2k = NULL;
 	file->md5 = NULL;
+	file->sha1 = NULL;
+	file->crc32 = NULL;
 
 	hashfs_db_tran_begin();
 	hashfs_db_entry_set(file->entry, "path", filename);
 	hashfs_db_entry_set(file->entry, "basename", hashfs_basename(filename));
 
+	if (found) {
+		file->fingerprint = hashfs_file_fingerprint(&info);
+
+		hashfs_file_cache_load(file, file->fingerprint);
+	}
+
 	return file;
 }
 
+/* TRUE if the entry of a file has key set to its fingerprint, as
+   stored after it was last handled. Only reads the database */
+gboolean
+hashfs_file_unchanged (const gchar *filename, struct stat *info, const gchar *key)
+{
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+	gchar *fingerprint;
+	gboolean rval;
+
+	fingerprint = hashfs_file_fingerprint(info);
+	entry = hashfs_db_entry_new("file", filename, NULL, NULL);
+
+	rval = hashfs_db_entry_lookup(entry, key, &val) && !g_strcmp0(val, fingerprint);
+
+	hashfs_db_entry_destroy(entry);
+	g_free(fingerprint);
+
+	return rval;
+}
+
+/* Drop the entry of a file that is gone */
+void
+hashfs_file_remove (const gchar *filename)
+{
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+
+	entry = hashfs_db_entry_new("file", filename, NULL, NULL);
+
+	if (hashfs_db_entry_lookup(entry, "path", &val)) {
+		HASHFS_DEBUG("File (%s) removing", hashfs_basename(filename));
+
+		hashfs_db_entry_remove(entry);
+	}
+
+	hashfs_db_entry_destroy(entry);
+}
+
+/* Carry the entry of a file over to the path it was moved to, with
+   its digests and whatever backends stored for it */
+gboolean
+hashfs_file_move (const gchar *from, const gchar *to)
+{
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+	gboolean rval = FALSE;
+
+	entry = hashfs_db_entry_new("file", from, NULL, NULL);
+
+	if (hashfs_db_entry_lookup(entry, "path", &val)) {
+		HASHFS_DEBUG("File (%s) moved to %s", hashfs_basename(from), to);
+
+		hashfs_db_entry_set(entry, "path", to);
+		hashfs_db_entry_set(entry, "basename", hashfs_basename(to));
+
+		rval = hashfs_db_entry_move(entry, "file", to);
+	}
+
+	hashfs_db_entry_destroy(entry);
+
+	return rval;
+}
+
+/* Whether the file an entry describes is no longer at its path, it
+   was moved, deleted or replaced since */
+static gboolean
+hashfs_file_vanished (hashfs_db_entry_t *entry)
+{
+	struct stat info;
+	const gchar *path, *val;
+	gchar *fingerprint;
+	gboolean rval = TRUE;
+
+	if (!hashfs_db_entry_lookup(entry, "path", &path))
+		return FALSE;
+
+	if (g_stat(path, &info) == 0) {
+		fingerprint = hashfs_file_fingerprint(&info);
+
+		if (hashfs_db_entry_lookup(entry, "hashfs:stat", &val) && !g_strcmp0(val, fingerprint))
+			rval = FALSE;
+
+		g_free(fingerprint);
+	}
+
+	return rval;
+}
+
+/* Give a file without an entry the one it had before it was renamed
+   or moved, found by its device, inode, size and mtime. Hard links
+   are left alone, the other path still has the same file */
+gboolean
+hashfs_file_find_moved (const gchar *filename, struct stat *info)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+	gchar *fingerprint, *querystr, *from = NULL;
+
+	entry = hashfs_db_entry_new("file", filename, NULL, NULL);
+
+	if (hashfs_db_entry_lookup(entry, "path", &val)) {
+		hashfs_db_entry_destroy(entry);
+
+		return FALSE;
+	}
+
+	hashfs_db_entry_destroy(entry);
+
+	fingerprint = hashfs_file_fingerprint(info);
+	querystr = g_strdup_printf("hashfs:stat.Equals(%s)", fingerprint);
+	query = hashfs_db_query_new(querystr);
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result) && !from; i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+
+		if (hashfs_file_vanished(entry) && hashfs_db_entry_lookup(entry, "path", &val))
+			from = g_strdup(val);
+
+		hashfs_db_entry_destroy(entry);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+	g_free(querystr);
+	g_free(fingerprint);
+
+	if (from) {
+		hashfs_file_move(from, filename);
+		g_free(from);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* A file that isn't tied to a database entry, carrying the cached
+   digests and checkpoint its entry has for it. Nothing is written
+   back, so it can be hashed from any thread and adopted later */
+hashfs_file_t *
+hashfs_file_peek (const gchar *filename, struct stat *info)
+{
+	hashfs_db_entry_t *entry;
+	hashfs_file_t *file;
+	const gchar *val;
+	gsize len;
+
+	file = g_new0(hashfs_file_t, 1);
+	file->filename = g_strdup(filename);
+	file->size = info->st_size;
+	file->fingerprint = hashfs_file_fingerprint(info);
+
+	entry = hashfs_db_entry_new("file", filename, NULL, NULL);
+
+	if (hashfs_file_cache_read(file, entry, file->fingerprint) &&
+	    hashfs_db_entry_lookup(entry, "hashfs:ed2k_blocks", &val) && *val) {
+		file->block_hashes = g_base64_decode(val, &len);
+		file->block_count = len / 16;
+	}
+
+	hashfs_db_entry_destroy(entry);
+
+	return file;
+}
+
+/* An entry of a file hashed at another path, as long as that file
+   didn't change since. Files that moved or are gone still count,
+   their digests describe the same data */
+static gboolean
+hashfs_file_copy_valid (hashfs_file_t *file, hashfs_db_entry_t *entry)
+{
+	struct stat info;
+	const gchar *path, *val;
+	gchar *fingerprint;
+	gboolean rval = TRUE;
+
+	if (!hashfs_db_entry_lookup(entry, "path", &path) || !g_strcmp0(path, file->filename))
+		return FALSE;
+
+	if (!hashfs_db_entry_lookup(entry, "hashfs:ed2k", &val) || !*val)
+		return FALSE;
+
+	if (g_stat(path, &info) == 0) {
+		fingerprint = hashfs_file_fingerprint(&info);
+
+		if (!hashfs_db_entry_lookup(entry, "hashfs:stat", &val) || g_strcmp0(val, fingerprint) != 0)
+			rval = FALSE;
+
+		g_free(fingerprint);
+	}
+
+	return rval;
+}
+
+/* Take the digests of another file with the same quick fingerprint
+   instead of hashing this one, returns TRUE if there was one. The
+   rest of its metadata is copied when the file is adopted */
+gboolean
+hashfs_file_copy_lookup (hashfs_file_t *file)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+	gchar *querystr, **field;
+	gint blocks;
+	gsize len;
+
+	if (!file->quick || file->entry)
+		return FALSE;
+
+	querystr = g_strdup_printf("hashfs:quick.Equals(%s)", file->quick);
+	query = hashfs_db_query_new(querystr);
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result) && !file->copy_of; i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+
+		if (hashfs_file_copy_valid(file, entry)) {
+			for (gint j = 0; j < LENGTH(cache_keys); j++) {
+				field = hashfs_file_cache_field(file, j);
+
+				if (!*field && hashfs_db_entry_lookup(entry, cache_keys[j], &val) && *val)
+					*field = g_strdup(val);
+			}
+
+			blocks = hashfs_ed2k_blocks(file->size);
+
+			if (blocks > 1 && hashfs_db_entry_lookup(entry, "hashfs:ed2k_blocks", &val) && *val) {
+				g_free(file->block_hashes);
+
+				file->block_hashes = g_base64_decode(val, &len);
+				file->block_count = len / 16;
+			}
+
+			file->copy_of = g_strdup(hashfs_db_entry_pkey(entry));
+
+			HASHFS_DEBUG("File (%s) is a copy of %s, using its digests",
+			             hashfs_basename(file->filename), file->copy_of);
+		}
+
+		hashfs_db_entry_destroy(entry);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+	g_free(querystr);
+
+	return file->copy_of != NULL;
+}
+
+/* Find the entry of a hashed file moved here from another filesystem
+   by its ed2k, for files too small or sparse to have been matched by
+   their quick samples. Only entries whose path is gone count, and
+   only for files without an entry of their own. The entry is taken
+   over when the file is adopted */
+gboolean
+hashfs_file_moved_lookup (hashfs_file_t *file)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	struct stat info;
+	const gchar *path, *val;
+	gchar *querystr, **fields;
+
+	if (!file->ed2k || file->copy_of || file->entry || file->size < 1)
+		return FALSE;
+
+	entry = hashfs_db_entry_new("file", file->filename, NULL, NULL);
+
+	if (hashfs_db_entry_lookup(entry, "path", &val)) {
+		hashfs_db_entry_destroy(entry);
+
+		return FALSE;
+	}
+
+	hashfs_db_entry_destroy(entry);
+
+	querystr = g_strdup_printf("hashfs:ed2k.Equals(%s)", file->ed2k);
+	query = hashfs_db_query_new(querystr);
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result) && !file->copy_of; i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+
+		/* Device, inode, size and mtime, the size has to match */
+		if (hashfs_db_entry_lookup(entry, "path", &path) && g_stat(path, &info) != 0 &&
+		    hashfs_db_entry_lookup(entry, "hashfs:stat", &val)) {
+			fields = g_strsplit(val, ":", 4);
+
+			if (g_strv_length(fields) == 4 && g_ascii_strtoll(fields[2], NULL, 10) == file->size) {
+				file->copy_of = g_strdup(hashfs_db_entry_pkey(entry));
+
+				HASHFS_DEBUG("File (%s) has the digests of %s, taking its entry",
+				             hashfs_basename(file->filename), path);
+			}
+
+			g_strfreev(fields);
+		}
+
+		hashfs_db_entry_destroy(entry);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+	g_free(querystr);
+
+	return file->copy_of != NULL;
+}
+
+/* Take the digests hashed into a detached file, as long as both saw
+   the same version of it */
+void
+hashfs_file_adopt (hashfs_file_t *file, hashfs_file_t *from)
+{
+	hashfs_db_entry_t *entry;
+	gchar **field, *val;
+	gint blocks;
+
+	if (!file->fingerprint || g_strcmp0(file->fingerprint, from->fingerprint) != 0)
+		return;
+
+	for (gint i = 0; i < LENGTH(cache_keys); i++) {
+		field = hashfs_file_cache_field(file, i);
+
+		if (!*field && (val = *hashfs_file_cache_field(from, i)))
+			*field = g_strdup(val);
+	}
+
+	blocks = hashfs_ed2k_blocks(file->size);
+
+	if (blocks > 1 && from->block_count == blocks)
+		hashfs_file_block_hashes_set(file, from->block_hashes, blocks);
+
+	hashfs_file_cache_store(file);
+
+	if (from->copy_of) {
+		entry = hashfs_db_entry_new_from_key(from->copy_of);
+		hashfs_db_entry_fill(file->entry, entry);
+
+		/* Moved to another filesystem rather than copied, the entry
+		   at the old path has nothing left to describe */
+		if (hashfs_file_vanished(entry)) {
+			HASHFS_DEBUG("File (%s) moved from %s", hashfs_basename(file->filename), from->copy_of);
+
+			hashfs_db_entry_remove(entry);
+		}
+
+		hashfs_db_entry_destroy(entry);
+	}
+}
+
 gboolean
 hashfs_file_prop_lookup (hashfs_file_t *file, const gchar *key,
                          const gchar **out)
@@ -54,7 +586,7 @@ hashfs_file_add_to_set (hashfs_file_t *file, const gchar *name,
 	if (file->backend)
 		source = file->backend->desc->shortname;
 	else
-		source = "unknown";
+		source = "hashfs";
 
 	set = hashfs_set_new(name, source, type);
 
@@ -70,17 +602,26 @@ hashfs_file_destroy (hashfs_file_t *file)
 {
 	HASHFS_DEBUG("File (%s) destroying", hashfs_basename(file->filename));
 
-	hashfs_db_tran_commit();
-
 	if (file->filename)
 		g_free(file->filename);
 
+	g_free(file->fingerprint);
+	g_free(file->quick);
+	g_free(file->copy_of);
+	g_free(file->block_hashes);
+
 	if (file->ed2k)
 		g_free(file->ed2k);
 
 	if (file->md5)
 		g_free(file->md5);
 
+	if (file->sha1)
+		g_free(file->sha1);
+
+	if (file->crc32)
+		g_free(file->crc32);
+
 	if (file->sets) {
 		GList *item;
 		hashfs_set_t *set;
@@ -92,9 +633,11 @@ hashfs_file_destroy (hashfs_file_t *file)
 		g_list_free(file->sets);
 	}
 
+	/* Sets and the file go into the transaction they were read in */
 	if (file->entry) {
 		hashfs_db_entry_put(file->entry);
 		hashfs_db_entry_destroy(file->entry);
+		hashfs_db_tran_commit();
 	}
 
 
@@ -0,0 +1,178 @@
+#include <string.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+/* A general pattern and who it was added for */
+typedef struct hashfs_glob_spec_St {
+	GPatternSpec *spec;
+	gint owner;
+} hashfs_glob_spec_t;
+
+/* Globs of several owners matched in one go. Patterns that only fix
+   the extension, like *.mkv, are looked up by it, the rest share the
+   reversed filename GPatternSpec would work out for each of them */
+struct hashfs_glob_St {
+	/* Data given for the patterns, in the order first added */
+	GPtrArray *owners;
+
+	/* Owner indexes by extension, and the most dots in one */
+	GHashTable *exts;
+	gint max_dots;
+
+	GPtrArray *specs;
+};
+
+
+static void
+hashfs_glob_spec_free (gpointer data)
+{
+	hashfs_glob_spec_t *spec = data;
+
+	g_pattern_spec_free(spec->spec);
+	g_free(spec);
+}
+
+static void
+hashfs_glob_owners_free (gpointer data)
+{
+	g_list_free(data);
+}
+
+/* The part after "*." of patterns matching every name that ends in it */
+static const gchar *
+hashfs_glob_ext (const gchar *pattern)
+{
+	if (!g_str_has_prefix(pattern, "*.") || !pattern[2])
+		return NULL;
+
+	if (strpbrk(pattern + 2, "*?" G_DIR_SEPARATOR_S))
+		return NULL;
+
+	return pattern + 2;
+}
+
+static gint
+hashfs_glob_owner (hashfs_glob_t *glob, gpointer data)
+{
+	for (guint i = 0; i < glob->owners->len; i++) {
+		if (g_ptr_array_index(glob->owners, i) == data)
+			return i;
+	}
+
+	g_ptr_array_add(glob->owners, data);
+
+	return glob->owners->len - 1;
+}
+
+hashfs_glob_t *
+hashfs_glob_new (void)
+{
+	hashfs_glob_t *glob;
+
+	glob = g_new0(hashfs_glob_t, 1);
+	glob->owners = g_ptr_array_new();
+	glob->exts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, hashfs_glob_owners_free);
+	glob->specs = g_ptr_array_new_with_free_func(hashfs_glob_spec_free);
+
+	return glob;
+}
+
+void
+hashfs_glob_add (hashfs_glob_t *glob, const gchar *pattern, gpointer data)
+{
+	hashfs_glob_spec_t *spec;
+	const gchar *ext;
+	GList *owners;
+	gint owner, dots = 1;
+
+	owner = hashfs_glob_owner(glob, data);
+
+	if (!(ext = hashfs_glob_ext(pattern))) {
+		spec = g_new0(hashfs_glob_spec_t, 1);
+		spec->spec = g_pattern_spec_new(pattern);
+		spec->owner = owner;
+
+		g_ptr_array_add(glob->specs, spec);
+
+		return;
+	}
+
+	for (const gchar *ptr = ext; *ptr; ptr++) {
+		if (*ptr == '.')
+			dots++;
+	}
+
+	glob->max_dots = MAX(glob->max_dots, dots);
+
+	owners = g_hash_table_lookup(glob->exts, ext);
+
+	if (!owners)
+		g_hash_table_insert(glob->exts, g_strdup(ext), g_list_append(NULL, GINT_TO_POINTER(owner)));
+	else if (!g_list_find(owners, GINT_TO_POINTER(owner)))
+		owners = g_list_append(owners, GINT_TO_POINTER(owner));
+}
+
+/* Data of every owner with a pattern matching filename, in the order
+   they were added */
+GList *
+hashfs_glob_match (hashfs_glob_t *glob, const gchar *filename)
+{
+	hashfs_glob_spec_t *spec;
+	gboolean *hit;
+	gchar *reversed;
+	GList *matched = NULL;
+	gsize len;
+	gint dots = 0;
+
+	hit = g_newa(gboolean, glob->owners->len);
+	memset(hit, 0, sizeof(gboolean) * glob->owners->len);
+
+	len = strlen(filename);
+
+	/* Every extension the name could end in, up to as many dots as
+	   the longest one has */
+	for (const gchar *ptr = filename + len; ptr > filename && dots < glob->max_dots; ptr--) {
+		if (ptr[-1] == G_DIR_SEPARATOR)
+			break;
+
+		if (ptr[-1] != '.')
+			continue;
+
+		dots++;
+
+		for (GList *item = g_hash_table_lookup(glob->exts, ptr); item; item = g_list_next(item))
+			hit[GPOINTER_TO_INT(item->data)] = TRUE;
+	}
+
+	if (glob->specs->len > 0) {
+		reversed = g_utf8_strreverse(filename, len);
+
+		for (guint i = 0; i < glob->specs->len; i++) {
+			spec = g_ptr_array_index(glob->specs, i);
+
+			if (!hit[spec->owner] && g_pattern_match(spec->spec, len, filename, reversed))
+				hit[spec->owner] = TRUE;
+		}
+
+		g_free(reversed);
+	}
+
+	for (gint i = glob->owners->len - 1; i >= 0; i--) {
+		if (hit[i])
+			matched = g_list_prepend(matched, g_ptr_array_index(glob->owners, i));
+	}
+
+	return matched;
+}
+
+void
+hashfs_glob_destroy (hashfs_glob_t *glob)
+{
+	g_ptr_array_free(glob->owners, TRUE);
+	g_ptr_array_free(glob->specs, TRUE);
+	g_hash_table_destroy(glob->exts);
+
+	g_free(glob);
+}
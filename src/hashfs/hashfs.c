@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gmodule.h>
@@ -13,19 +15,26 @@ typedef struct hashfs_cmd_St {
 } hashfs_cmd_t;
 
 
-static void hashfs_hash_file (hashfs_backend_t *backend, gchar *path);
-static void hashfs_hash_dir (hashfs_backend_t  *backend, gchar *path);
-
 static void hashfs_cmd (hashfs_cmd_t *cmds, gchar *cmd, gint argv, gchar **args);
 static void hashfs_cmd_config (gint argc, gchar **argv);
+static void hashfs_cmd_dupes (gint argc, gchar **argv);
 static void hashfs_cmd_help (gint argc, gchar **argv);
+static void hashfs_cmd_ingest (gint argc, gchar **argv);
+static void hashfs_cmd_prune (gint argc, gchar **argv);
 static void hashfs_cmd_update (gint argc, gchar **argv);
+static void hashfs_cmd_verify (gint argc, gchar **argv);
+static void hashfs_cmd_watch (gint argc, gchar **argv);
 
 static
 hashfs_cmd_t main_cmds[] = {
 	{ "config", hashfs_cmd_config, "Manipulate configuration" },
+	{ "dupes",  hashfs_cmd_dupes,  "Find files with the same content" },
 	{ "help",   hashfs_cmd_help,   "Show available commands and description" },
+	{ "ingest", hashfs_cmd_ingest, "Copy files and hash them on the way" },
+	{ "prune",  hashfs_cmd_prune,  "Remove entries of deleted files" },
 	{ "update", hashfs_cmd_update, "Scan directory and add metadata" },
+	{ "verify", hashfs_cmd_verify, "Re-check stored ed2k blocks for corruption" },
+	{ "watch",  hashfs_cmd_watch,  "Hash and look up files as they come in" },
 
 	{ NULL, NULL, NULL},
 };
@@ -37,59 +46,6 @@ hashfs_cmd_t config_cmds[] = {
 };
 
 
-static void
-hashfs_hash_file (hashfs_backend_t *backend, gchar *path)
-{
-	if (hashfs_backend_glob_try(backend, path)) {
-		hashfs_file_t *file;
-
-		HASHFS_LOG("Handling file: %s", hashfs_basename(path));
-
-		file = hashfs_file_new(path, backend);
-		hashfs_backend_file(backend, file);
-
-		hashfs_file_destroy(file);
-	}
-}
-
-static void
-hashfs_hash_dir (hashfs_backend_t *backend, gchar *path)
-{
-	GDir *dir;
-	GError *error;
-	const gchar *filename;
-	gchar *fullpath;
-
-	HASHFS_LOG("Searching directory: %s", path);
-
-	error = NULL;
-	dir = g_dir_open(path, 0, &error);
-
-	if (error) {
-		HASHFS_DEBUG("Failed to open directory (%s): %s", path, error->message);
-		g_error_free(error);
-
-		return;
-	}
-
-	while ((filename = g_dir_read_name(dir))) {
-		if (!g_strcmp0(filename, ".") || !g_strcmp0(filename, ".."))
-			continue;
-
-		fullpath = g_build_filename(path, filename, NULL);
-
-		if (g_file_test(fullpath, G_FILE_TEST_IS_REGULAR)) {
-			hashfs_hash_file(backend, fullpath);
-		} else if (g_file_test(fullpath, G_FILE_TEST_IS_DIR)) {
-			hashfs_hash_dir(backend, fullpath);
-		}
-
-		g_free(fullpath);
-	}
-
-	g_dir_close(dir);
-}
-
 static void
 hashfs_cmd (hashfs_cmd_t *cmds, gchar *cmd, gint argv, gchar **args)
 {
@@ -162,6 +118,49 @@ hashfs_cmd_config (gint argc, gchar **argv)
 	}
 }
 
+static void
+hashfs_dupes_found (const gchar *filename, struct stat *info, gpointer data)
+{
+	hashfs_dupes_add(data, filename, info);
+}
+
+static void
+hashfs_dupes_print (const gchar *ed2k, gint64 size, GList *files, gpointer data)
+{
+	gint64 *wasted = data;
+
+	printf("%s  %" G_GINT64_FORMAT " bytes, %u files\n", ed2k, size, g_list_length(files));
+
+	for (GList *item = files; item; item = g_list_next(item))
+		printf("  %s\n", (gchar *) item->data);
+
+	*wasted += size * (g_list_length(files) - 1);
+}
+
+/* hashfs dupes PATH [PATH ...] */
+static void
+hashfs_cmd_dupes (gint argc, gchar **argv)
+{
+	hashfs_dupes_t *dupes;
+	gint64 wasted = 0;
+
+	if (argc == 0) {
+		printf("Usage: hashfs dupes PATH [PATH ...]\n");
+
+		return;
+	}
+
+	dupes = hashfs_dupes_new();
+
+	for (gint i = 0; i < argc; i++)
+		hashfs_walk(argv[i], hashfs_dupes_found, dupes);
+
+	hashfs_dupes_run(dupes, hashfs_dupes_print, &wasted);
+	hashfs_dupes_destroy(dupes);
+
+	printf("%" G_GINT64_FORMAT " bytes in extra copies\n", wasted);
+}
+
 static void
 hashfs_cmd_help (gint argc, gchar **argv)
 {
@@ -172,22 +171,302 @@ hashfs_cmd_help (gint argc, gchar **argv)
 	}
 }
 
+static void
+hashfs_ingest_path (const gchar *src, const gchar *dest, gint types)
+{
+	if (g_file_test(src, G_FILE_TEST_IS_DIR) && !g_file_test(src, G_FILE_TEST_IS_SYMLINK)) {
+		GDir *dir;
+		const gchar *filename;
+		gchar *srcpath, *destpath;
+
+		if (g_mkdir_with_parents(dest, 0755) != 0) {
+			printf("FAILED   %s (unable to create directory)\n", dest);
+
+			return;
+		}
+
+		if (!(dir = g_dir_open(src, 0, NULL)))
+			return;
+
+		while ((filename = g_dir_read_name(dir))) {
+			srcpath = g_build_filename(src, filename, NULL);
+			destpath = g_build_filename(dest, filename, NULL);
+
+			hashfs_ingest_path(srcpath, destpath, types);
+
+			g_free(srcpath);
+			g_free(destpath);
+		}
+
+		g_dir_close(dir);
+	} else if (g_file_test(src, G_FILE_TEST_IS_REGULAR)) {
+		hashfs_file_t *file, *copy;
+		struct stat info;
+
+		if (g_stat(src, &info) != 0)
+			return;
+
+		file = hashfs_file_peek(src, &info);
+
+		if (hashfs_file_copy(file, dest, types)) {
+			copy = hashfs_file_new(dest, NULL);
+			hashfs_file_adopt(copy, file);
+			hashfs_file_destroy(copy);
+
+			printf("OK       %s\n", dest);
+		} else {
+			printf("FAILED   %s\n", src);
+		}
+
+		hashfs_file_destroy(file);
+	}
+}
+
+/* hashfs ingest SRC DST, copying into DST when it's a directory */
+static void
+hashfs_cmd_ingest (gint argc, gchar **argv)
+{
+	gchar *src, *dest, *dir, *base;
+	gint types;
+
+	if (argc != 2) {
+		printf("Usage: hashfs ingest SRC DST\n");
+
+		return;
+	}
+
+	/* Entries are stored by path, the way update, watch and prune
+	   find them */
+	src = hashfs_canonical_path(argv[0]);
+	dir = hashfs_canonical_path(argv[1]);
+
+	if (g_file_test(dir, G_FILE_TEST_IS_DIR)) {
+		base = g_path_get_basename(src);
+		dest = g_build_filename(dir, base, NULL);
+		g_free(base);
+		g_free(dir);
+	} else {
+		dest = dir;
+	}
+
+	/* Whatever hashfs update would hash the copy for later on */
+	types = HASHFS_HASH_ED2K | hashfs_backends_hash_types();
+
+	hashfs_ingest_path(src, dest, types);
+
+	g_free(src);
+	g_free(dest);
+}
+
+static void
+hashfs_prune_print (const gchar *path, gpointer data)
+{
+	printf("GONE     %s\n", path);
+}
+
+/* hashfs prune [-n] [PATH ...] */
+static void
+hashfs_cmd_prune (gint argc, gchar **argv)
+{
+	hashfs_prune_t *prune;
+	gboolean dry_run = FALSE;
+
+	if (argc > 0 && !g_strcmp0(argv[0], "-n")) {
+		dry_run = TRUE;
+		argc--;
+		argv++;
+	}
+
+	prune = hashfs_prune_new(dry_run);
+
+	for (gint i = 0; i < argc; i++)
+		hashfs_prune_add(prune, argv[i]);
+
+	hashfs_prune_run(prune, hashfs_prune_print, NULL);
+	hashfs_prune_destroy(prune);
+}
+
+/* hashfs update [-i] [BACKEND] PATH, with every backend when none is
+   given */
 static void
 hashfs_cmd_update (gint argc, gchar **argv)
 {
 	hashfs_backend_t *backend;
+	hashfs_update_t *update;
+	GList *backends = NULL;
+	gboolean incremental = FALSE;
+
+	/* -i leaves out files a backend saw exactly like they are now */
+	if (argc > 0 && !g_strcmp0(argv[0], "-i")) {
+		incremental = TRUE;
+		argc--;
+		argv++;
+	}
 
-	if (argc == 0) {
+	if (argc == 1) {
+		for (gint i = 0; i < hashfs_backends_count(); i++)
+			backends = g_list_append(backends, hashfs_backends_get(i));
 	} else if (argc == 2) {
-		backend = hashfs_backends_lookup(argv[0]);
+		if ((backend = hashfs_backends_lookup(argv[0])))
+			backends = g_list_append(backends, backend);
+		else
+			HASHFS_LOG("No backend named %s", argv[0]);
+	} else {
+		printf("Usage: hashfs update [-i] [BACKEND] PATH\n");
+
+		return;
+	}
+
+	if (!backends)
+		return;
+
+	for (GList *item = backends; item; item = g_list_next(item))
+		hashfs_backend_init(item->data);
+
+	update = hashfs_update_new(backends, incremental);
+	hashfs_update_scan(update, argv[argc - 1]);
+	hashfs_update_run(update);
+	hashfs_update_destroy(update);
+
+	g_list_free(backends);
+}
+
+static void
+hashfs_verify_path (const gchar *path, GArray *blocks, gint samples)
+{
+	if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		GDir *dir;
+		const gchar *filename;
+		gchar *fullpath;
+
+		if (!(dir = g_dir_open(path, 0, NULL)))
+			return;
+
+		while ((filename = g_dir_read_name(dir))) {
+			fullpath = g_build_filename(path, filename, NULL);
+			hashfs_verify_path(fullpath, blocks, samples);
+			g_free(fullpath);
+		}
+
+		g_dir_close(dir);
+	} else if (g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+		GArray *bad;
+		struct stat info;
+
+		bad = g_array_new(FALSE, FALSE, sizeof(gint));
+
+		switch (hashfs_verify_file(path, blocks, samples, bad)) {
+		case HASHFS_VERIFY_OK:
+			printf("OK       %s\n", path);
+			break;
+		case HASHFS_VERIFY_CORRUPT:
+			printf("CORRUPT  %s\n", path);
+
+			g_stat(path, &info);
+
+			for (guint i = 0; i < bad->len; i++) {
+				gint index = g_array_index(bad, gint, i);
+				gint64 offset = (gint64) index * HASHFS_ED2K_BLOCKSIZE;
+				gint64 end = MIN(offset + HASHFS_ED2K_BLOCKSIZE, (gint64) info.st_size);
 
-		if (backend) {
-			hashfs_backend_init(backend);
-			hashfs_hash_dir(backend, argv[1]);
+				printf("  block %d, bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "\n",
+				       index, offset, end - 1);
+			}
+			break;
+		case HASHFS_VERIFY_CHANGED:
+			printf("CHANGED  %s (modified since it was hashed)\n", path);
+			break;
+		case HASHFS_VERIFY_UNKNOWN:
+			printf("UNKNOWN  %s (no stored block hashes)\n", path);
+			break;
+		case HASHFS_VERIFY_FAILED:
+			printf("FAILED   %s (unable to read)\n", path);
+			break;
 		}
+
+		g_array_free(bad, TRUE);
 	}
 }
 
+/* hashfs verify [-s SAMPLES] PATH [all|BLOCK[,BLOCK...]] */
+static void
+hashfs_cmd_verify (gint argc, gchar **argv)
+{
+	GArray *blocks = NULL;
+	gint samples = 4;
+
+	if (argc > 1 && !g_strcmp0(argv[0], "-s")) {
+		samples = MAX(atoi(argv[1]), 1);
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc == 0 || argc > 2) {
+		printf("Usage: hashfs verify [-s SAMPLES] PATH [all|BLOCK[,BLOCK...]]\n");
+
+		return;
+	}
+
+	if (argc > 1) {
+		if (!g_strcmp0(argv[1], "all")) {
+			samples = 0;
+		} else {
+			gchar **split;
+
+			split = g_strsplit(argv[1], ",", -1);
+			blocks = g_array_new(FALSE, FALSE, sizeof(gint));
+
+			for (gint i = 0; split[i]; i++) {
+				gint index;
+
+				if (!*split[i])
+					continue;
+
+				index = atoi(split[i]);
+				g_array_append_val(blocks, index);
+			}
+
+			g_strfreev(split);
+		}
+	}
+
+	hashfs_verify_path(argv[0], blocks, samples);
+
+	if (blocks)
+		g_array_unref(blocks);
+}
+
+/* hashfs watch PATH [PATH ...] */
+static void
+hashfs_cmd_watch (gint argc, gchar **argv)
+{
+	hashfs_watch_t *watch;
+	GList *backends = NULL;
+
+	if (argc == 0) {
+		printf("Usage: hashfs watch PATH [PATH ...]\n");
+
+		return;
+	}
+
+	for (gint i = 0; i < hashfs_backends_count(); i++) {
+		backends = g_list_append(backends, hashfs_backends_get(i));
+		hashfs_backend_init(hashfs_backends_get(i));
+	}
+
+	watch = hashfs_watch_new(backends);
+
+	for (gint i = 0; i < argc; i++) {
+		if (!hashfs_watch_add(watch, argv[i]))
+			HASHFS_LOG("Unable to watch %s", argv[i]);
+	}
+
+	hashfs_watch_run(watch);
+	hashfs_watch_destroy(watch);
+
+	g_list_free(backends);
+}
+
 gint
 main (gint argc, gchar **argv)
 {
@@ -197,6 +476,8 @@ main (gint argc, gchar **argv)
 	if (!hashfs_db_init(FALSE))
 		HASHFS_ERROR("Unable to open database");
 
+	hashfs_hash_init();
+
 	if (g_module_supported()) {
 		hashfs_backends_load("/usr/local/lib/hashfs");
 		hashfs_backends_load("./_build_/default/src/backends/anidb/");
@@ -213,6 +494,7 @@ main (gint argc, gchar **argv)
 
 
 	hashfs_backends_destroy();
+	hashfs_hash_destroy();
 	hashfs_config_destroy();
 	hashfs_db_destroy();
 
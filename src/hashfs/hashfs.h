@@ -13,30 +13,73 @@
 
 struct hashfs_backend_St;
 struct hashfs_backend_desc_St;
+struct hashfs_block_St;
 struct hashfs_db_St;
 struct hashfs_db_entry_St;
 struct hashfs_db_result_St;
 struct hashfs_db_query_St;
+struct hashfs_dupes_St;
+struct hashfs_ed2k_St;
 struct hashfs_file_St;
+struct hashfs_glob_St;
+struct hashfs_prune_St;
+struct hashfs_reader_St;
+struct hashfs_sched_St;
 struct hashfs_set_St;
+struct hashfs_update_St;
+struct hashfs_watch_St;
 
 typedef struct hashfs_backend_St hashfs_backend_t;
 typedef struct hashfs_backend_desc_St hashfs_backend_desc_t;
+typedef struct hashfs_block_St hashfs_block_t;
 typedef struct hashfs_db_St hashfs_db_t;
 typedef struct hashfs_db_entry_St hashfs_db_entry_t;
 typedef struct hashfs_db_result_St hashfs_db_result_t;
 typedef struct hashfs_db_query_St hashfs_db_query_t;
+typedef struct hashfs_dupes_St hashfs_dupes_t;
+typedef struct hashfs_ed2k_St hashfs_ed2k_t;
 typedef struct hashfs_file_St hashfs_file_t;
+typedef struct hashfs_glob_St hashfs_glob_t;
+typedef struct hashfs_prune_St hashfs_prune_t;
+typedef struct hashfs_reader_St hashfs_reader_t;
+typedef struct hashfs_sched_St hashfs_sched_t;
 typedef struct hashfs_set_St hashfs_set_t;
+typedef struct hashfs_update_St hashfs_update_t;
+typedef struct hashfs_watch_St hashfs_watch_t;
+
+typedef enum {
+	HASHFS_HASH_ED2K  = 1 << 0,
+	HASHFS_HASH_MD5   = 1 << 1,
+	HASHFS_HASH_SHA1  = 1 << 2,
+	HASHFS_HASH_CRC32 = 1 << 3,
+} hashfs_hash_type_t;
+
+typedef enum {
+	HASHFS_VERIFY_OK,
+	HASHFS_VERIFY_CORRUPT,
+	HASHFS_VERIFY_CHANGED,
+	HASHFS_VERIFY_UNKNOWN,
+	HASHFS_VERIFY_FAILED,
+} hashfs_verify_status_t;
+
+#define HASHFS_ED2K_BLOCKSIZE (9500*1024)
+#define HASHFS_MD4_MAX_LANES 16
 
 struct hashfs_backend_St {
 	gpointer data;
-	GList *globs;
 	GModule *module;
 
+	/* Patterns given, and compiled to match them */
+	GList *globs;
+	hashfs_glob_t *glob;
+
+	/* Digests the file handler asks for, hashed ahead of it */
+	gint hash_types;
+
 	struct {
 		gboolean (*init)(hashfs_backend_t *);
-		void (*file)(hashfs_backend_t *, hashfs_file_t *);
+		/* FALSE when the file couldn't be handled this time */
+		gboolean (*file)(hashfs_backend_t *, hashfs_file_t *);
 		void (*destroy)(hashfs_backend_t *);
 	} funcs;
 
@@ -50,10 +93,30 @@ struct hashfs_backend_desc_St {
 	void (*setup_func)(hashfs_backend_t *);
 };
 
+struct hashfs_block_St {
+	gint index;
+	gint64 offset;
+	gsize len;
+	guchar *data;
+
+	/* Inside a hole, data is shared zeros and must not be written */
+	gboolean zero;
+
+	gint refcount;
+};
+
 struct hashfs_db_St {
 	TCTDB *tdb;
 	gchar *path;
 	gint flags;
+
+	/* Batch of files in the open transaction */
+	GMutex tran_lock;
+	gboolean tran;
+	gint tran_files;
+	gint64 tran_start;
+	gint commit_files;
+	gint commit_ms;
 };
 
 struct hashfs_db_entry_St {
@@ -80,6 +143,23 @@ struct hashfs_file_St {
 	/* Hashes */
 	gchar *ed2k;
 	gchar *md5;
+	gchar *sha1;
+	gchar *crc32;
+
+	/* hashfs:stat of the file when it was opened */
+	gchar *fingerprint;
+
+	/* hashfs:quick, and the entry of an identical file the digests
+	   were copied from */
+	gchar *quick;
+	gchar *copy_of;
+
+	/* Detached files keep their ed2k block digests here, and hand
+	   checkpoints to checkpoint_func */
+	guchar *block_hashes;
+	gint block_count;
+	void (*checkpoint_func)(hashfs_file_t *, const guchar *, gint, gpointer);
+	gpointer checkpoint_data;
 };
 
 struct hashfs_set_St {
@@ -94,6 +174,8 @@ void hashfs_config_destroy (void);
 gboolean hashfs_config_property_exists (const gchar *group, const gchar *key);
 void hashfs_config_property_lookup (const gchar *group, const gchar *key, gchar **out);
 void hashfs_config_property_set (const gchar *group, const gchar *key, const gchar *value);
+void hashfs_config_property_register (const gchar *group, const gchar *key, const gchar *defaultval);
+gint hashfs_config_property_lookup_int (const gchar *group, const gchar *key);
 
 
 /* Database */
@@ -101,19 +183,26 @@ gboolean hashfs_db_init (gboolean readonly);
 void hashfs_db_destroy (void);
 gchar * hashfs_db_error (void);
 
-gboolean hashfs_db_tran_abort (void);
 gboolean hashfs_db_tran_begin (void);
 gboolean hashfs_db_tran_commit (void);
+gint hashfs_db_tran_due (void);
+gboolean hashfs_db_tran_flush (void);
 
 
 /* Database entry */
+typedef void (*hashfs_db_entry_func) (const gchar *key, const gchar *value, gpointer data);
+
 hashfs_db_entry_t * hashfs_db_entry_new (const gchar *prefix, const gchar *id, const gchar *source, const gchar *type);
 hashfs_db_entry_t * hashfs_db_entry_new_from_key (const gchar *key);
 gboolean hashfs_db_entry_lookup (hashfs_db_entry_t *entry, const gchar *key, const gchar **out);
 gchar * hashfs_db_entry_format (hashfs_db_entry_t *entry, const gchar *format);
 const gchar * hashfs_db_entry_pkey (hashfs_db_entry_t *entry);
 void hashfs_db_entry_set (hashfs_db_entry_t *entry, const gchar *key, const gchar *value);
+void hashfs_db_entry_fill (hashfs_db_entry_t *entry, hashfs_db_entry_t *from);
+void hashfs_db_entry_foreach (hashfs_db_entry_t *entry, hashfs_db_entry_func func, gpointer data);
 gboolean hashfs_db_entry_put (hashfs_db_entry_t *entry);
+gboolean hashfs_db_entry_remove (hashfs_db_entry_t *entry);
+gboolean hashfs_db_entry_move (hashfs_db_entry_t *entry, const gchar *prefix, const gchar *id);
 void hashfs_db_entry_destroy (hashfs_db_entry_t *entry);
 
 
@@ -139,10 +228,83 @@ void hashfs_set_prop_set (hashfs_set_t *file, const gchar *key, const gchar *val
 void hashfs_set_destroy (hashfs_set_t *set);
 
 
+/* Hashing */
+void hashfs_hash_init (void);
+void hashfs_hash_destroy (void);
+gint hashfs_hash_streams (gint streams);
+
+
+/* Block */
+void hashfs_block_pool_init (gint max);
+void hashfs_block_pool_destroy (void);
+gint hashfs_block_pool_size (void);
+hashfs_block_t * hashfs_block_new (gint index, gint64 offset, gsize len);
+hashfs_block_t * hashfs_block_try_new (gint index, gint64 offset, gsize len);
+hashfs_block_t * hashfs_block_zero (gint index, gint64 offset, gsize len);
+hashfs_block_t * hashfs_block_ref (hashfs_block_t *block);
+void hashfs_block_unref (hashfs_block_t *block);
+
+
+/* Reader */
+void hashfs_readers_init (gboolean dropcache, const gchar *engine, gint depth);
+void hashfs_readers_destroy (void);
+void hashfs_readers_set_depth (gint depth);
+void hashfs_reader_set_next (const gchar *filename);
+hashfs_reader_t * hashfs_reader_new (const gchar *filename, gint64 size);
+hashfs_block_t * hashfs_reader_next (hashfs_reader_t *reader);
+void hashfs_reader_seek (hashfs_reader_t *reader, gint index);
+hashfs_block_t * hashfs_reader_read (hashfs_reader_t *reader, gint index);
+gboolean hashfs_reader_failed (hashfs_reader_t *reader);
+void hashfs_reader_destroy (hashfs_reader_t *reader);
+
+
+/* MD4 */
+gboolean hashfs_md4_set_kernel (const gchar *name);
+const gchar * hashfs_md4_kernel (void);
+gint hashfs_md4_lanes (void);
+void hashfs_md4 (const guchar *data, gsize len, guchar *out);
+void hashfs_md4_multi (const guchar **data, const gsize *len, guchar **out, gint n);
+
+
+/* ed2k */
+void hashfs_ed2k_init (gint threads);
+void hashfs_ed2k_destroy (void);
+void hashfs_ed2k_set_streams (gint streams);
+gboolean hashfs_ed2k_set_engine (const gchar *name, gboolean dropcache);
+gboolean hashfs_ed2k_offload (void);
+gint hashfs_ed2k_blocks (gint64 size);
+hashfs_ed2k_t * hashfs_ed2k_new (gint64 size);
+void hashfs_ed2k_update (hashfs_ed2k_t *ed2k, hashfs_block_t *block);
+void hashfs_ed2k_update_fd (hashfs_ed2k_t *ed2k, gint fd, gint index);
+void hashfs_ed2k_resume (hashfs_ed2k_t *ed2k, const guchar *hashes, gint blocks);
+gboolean hashfs_ed2k_sync (hashfs_ed2k_t *ed2k);
+const guchar * hashfs_ed2k_block_hashes (hashfs_ed2k_t *ed2k);
+gboolean hashfs_ed2k_final (hashfs_ed2k_t *ed2k, gchar **out);
+
+
 /* File */
 hashfs_file_t * hashfs_file_new (const gchar *filename, hashfs_backend_t *backend);
+hashfs_file_t * hashfs_file_peek (const gchar *filename, struct stat *info);
+void hashfs_file_adopt (hashfs_file_t *file, hashfs_file_t *from);
+gboolean hashfs_file_hash (hashfs_file_t *file, gint types);
+gint hashfs_file_missing (hashfs_file_t *file, gint types);
+gboolean hashfs_file_copy (hashfs_file_t *file, const gchar *dest, gint types);
+gchar * hashfs_file_fingerprint (struct stat *info);
+gboolean hashfs_file_unchanged (const gchar *filename, struct stat *info, const gchar *key);
+void hashfs_file_remove (const gchar *filename);
+gboolean hashfs_file_move (const gchar *from, const gchar *to);
+gboolean hashfs_file_find_moved (const gchar *filename, struct stat *info);
+gchar * hashfs_file_quick (const gchar *filename, struct stat *info);
+gboolean hashfs_file_copy_lookup (hashfs_file_t *file);
+gboolean hashfs_file_moved_lookup (hashfs_file_t *file);
+void hashfs_file_cache_store (hashfs_file_t *file);
+void hashfs_file_block_hashes_set (hashfs_file_t *file, const guchar *hashes, gint blocks);
+gint hashfs_file_checkpoint_load (hashfs_file_t *file, guchar **hashes);
+void hashfs_file_checkpoint (hashfs_file_t *file, const guchar *hashes, gint blocks);
 gboolean hashfs_file_hash_ed2k (hashfs_file_t *file, const gchar **out);
 gboolean hashfs_file_hash_md5 (hashfs_file_t *file, const gchar **out);
+gboolean hashfs_file_hash_sha1 (hashfs_file_t *file, const gchar **out);
+gboolean hashfs_file_hash_crc32 (hashfs_file_t *file, const gchar **out);
 gboolean hashfs_file_prop_lookup (hashfs_file_t *file, const gchar *key, const gchar **out);
 void hashfs_file_prop_set (hashfs_file_t *file, const gchar *key, const gchar *value);
 hashfs_set_t * hashfs_file_add_to_set (hashfs_file_t *file, const gchar *name, const gchar *type);
@@ -153,6 +315,7 @@ void hashfs_file_destroy (hashfs_file_t *file);
 hashfs_backend_t * hashfs_backends_lookup (const gchar *name);
 hashfs_backend_t * hashfs_backends_get (gint idx);
 gint hashfs_backends_count (void);
+gint hashfs_backends_hash_types (void);
 void hashfs_backends_load (const gchar *path);
 void hashfs_backends_destroy (void);
 
@@ -160,18 +323,82 @@ void hashfs_backends_destroy (void);
 /* Backend */
 hashfs_backend_t * hashfs_backend_load (const gchar *path);
 void hashfs_backend_init (hashfs_backend_t *backend);
-void hashfs_backend_file (hashfs_backend_t *backend, hashfs_file_t *file);
+gboolean hashfs_backend_file (hashfs_backend_t *backend, hashfs_file_t *file);
 void hashfs_backend_destroy (hashfs_backend_t *backend);
 void hashfs_backend_glob_set (hashfs_backend_t *backend, ...);
 gboolean hashfs_backend_glob_try (hashfs_backend_t *backend, const gchar *filename);
+void hashfs_backend_glob_add (hashfs_backend_t *backend, hashfs_glob_t *glob);
 void hashfs_backend_config_register (hashfs_backend_t *backend, const gchar *key, const gchar *defaultval);
 void hashfs_backend_config_lookup (hashfs_backend_t *backend, const gchar *key, gchar **out);
 
 
+/* Scheduler */
+typedef void (*hashfs_sched_func) (hashfs_file_t *file, gpointer data);
+
+hashfs_sched_t * hashfs_sched_new (void);
+void hashfs_sched_set_copies (hashfs_sched_t *sched, gboolean copies);
+void hashfs_sched_add (hashfs_sched_t *sched, const gchar *filename, struct stat *info, gint types);
+void hashfs_sched_close (hashfs_sched_t *sched);
+void hashfs_sched_run (hashfs_sched_t *sched, hashfs_sched_func func, gpointer data);
+void hashfs_sched_destroy (hashfs_sched_t *sched);
+
+
+/* Duplicates */
+typedef void (*hashfs_dupes_func) (const gchar *ed2k, gint64 size, GList *files, gpointer data);
+
+hashfs_dupes_t * hashfs_dupes_new (void);
+void hashfs_dupes_add (hashfs_dupes_t *dupes, const gchar *filename, struct stat *info);
+void hashfs_dupes_run (hashfs_dupes_t *dupes, hashfs_dupes_func func, gpointer data);
+void hashfs_dupes_destroy (hashfs_dupes_t *dupes);
+
+
+/* Glob */
+hashfs_glob_t * hashfs_glob_new (void);
+void hashfs_glob_add (hashfs_glob_t *glob, const gchar *pattern, gpointer data);
+GList * hashfs_glob_match (hashfs_glob_t *glob, const gchar *filename);
+void hashfs_glob_destroy (hashfs_glob_t *glob);
+
+
+/* Prune */
+typedef void (*hashfs_prune_func) (const gchar *path, gpointer data);
+
+hashfs_prune_t * hashfs_prune_new (gboolean dry_run);
+void hashfs_prune_add (hashfs_prune_t *prune, const gchar *path);
+void hashfs_prune_run (hashfs_prune_t *prune, hashfs_prune_func func, gpointer data);
+void hashfs_prune_destroy (hashfs_prune_t *prune);
+
+
+/* Update */
+hashfs_update_t * hashfs_update_new (GList *backends, gboolean incremental);
+void hashfs_update_scan (hashfs_update_t *update, const gchar *path);
+void hashfs_update_run (hashfs_update_t *update);
+void hashfs_update_destroy (hashfs_update_t *update);
+
+
+/* Watch */
+hashfs_watch_t * hashfs_watch_new (GList *backends);
+gboolean hashfs_watch_add (hashfs_watch_t *watch, const gchar *path);
+void hashfs_watch_run (hashfs_watch_t *watch);
+void hashfs_watch_destroy (hashfs_watch_t *watch);
+
+
+/* Walker */
+typedef void (*hashfs_walk_func) (const gchar *filename, struct stat *info, gpointer data);
+
+void hashfs_walk (const gchar *path, hashfs_walk_func func, gpointer data);
+
+
+/* Verify */
+hashfs_verify_status_t hashfs_verify_file (const gchar *filename, GArray *blocks, gint samples, GArray *bad);
+
+
 /* Utils */
 gchar * hashfs_current_time (void);
 gchar * hashfs_basename (const gchar *name);
+gchar * hashfs_canonical_path (const gchar *path);
 gchar * hashfs_md5_str (const gchar *str);
+gchar * hashfs_hex_str (const guchar *data, gsize len);
+guchar * hashfs_hex_bin (const gchar *str, gsize *len);
 
 
 #define HASHFS_BACKEND(shname, name, desc, setupfunc) \
@@ -0,0 +1,364 @@
+#include <string.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define HASHFS_MD4_X86 1
+	#include <immintrin.h>
+#endif
+
+typedef void (*hashfs_md4_kernel_func) (guint32 *state, const guchar **data,
+                                        gsize offset, gsize blocks);
+
+typedef struct {
+	const gchar *name;
+	const gchar *feature;
+	gint lanes;
+	hashfs_md4_kernel_func func;
+} hashfs_md4_kernel_t;
+
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define MD4_K2 0x5a827999
+#define MD4_K3 0x6ed9eba1
+
+/* The 48 MD4 steps, written once for both the scalar and vector
+   kernels in terms of F/G/H, ADD, ROL and K */
+#define MD4_ROUNDS(a, b, c, d, X) \
+	MD4_STEP(F, a, b, c, d, X[ 0], 0,  3); MD4_STEP(F, d, a, b, c, X[ 1], 0,  7); \
+	MD4_STEP(F, c, d, a, b, X[ 2], 0, 11); MD4_STEP(F, b, c, d, a, X[ 3], 0, 19); \
+	MD4_STEP(F, a, b, c, d, X[ 4], 0,  3); MD4_STEP(F, d, a, b, c, X[ 5], 0,  7); \
+	MD4_STEP(F, c, d, a, b, X[ 6], 0, 11); MD4_STEP(F, b, c, d, a, X[ 7], 0, 19); \
+	MD4_STEP(F, a, b, c, d, X[ 8], 0,  3); MD4_STEP(F, d, a, b, c, X[ 9], 0,  7); \
+	MD4_STEP(F, c, d, a, b, X[10], 0, 11); MD4_STEP(F, b, c, d, a, X[11], 0, 19); \
+	MD4_STEP(F, a, b, c, d, X[12], 0,  3); MD4_STEP(F, d, a, b, c, X[13], 0,  7); \
+	MD4_STEP(F, c, d, a, b, X[14], 0, 11); MD4_STEP(F, b, c, d, a, X[15], 0, 19); \
+	\
+	MD4_STEP(G, a, b, c, d, X[ 0], MD4_K2,  3); MD4_STEP(G, d, a, b, c, X[ 4], MD4_K2,  5); \
+	MD4_STEP(G, c, d, a, b, X[ 8], MD4_K2,  9); MD4_STEP(G, b, c, d, a, X[12], MD4_K2, 13); \
+	MD4_STEP(G, a, b, c, d, X[ 1], MD4_K2,  3); MD4_STEP(G, d, a, b, c, X[ 5], MD4_K2,  5); \
+	MD4_STEP(G, c, d, a, b, X[ 9], MD4_K2,  9); MD4_STEP(G, b, c, d, a, X[13], MD4_K2, 13); \
+	MD4_STEP(G, a, b, c, d, X[ 2], MD4_K2,  3); MD4_STEP(G, d, a, b, c, X[ 6], MD4_K2,  5); \
+	MD4_STEP(G, c, d, a, b, X[10], MD4_K2,  9); MD4_STEP(G, b, c, d, a, X[14], MD4_K2, 13); \
+	MD4_STEP(G, a, b, c, d, X[ 3], MD4_K2,  3); MD4_STEP(G, d, a, b, c, X[ 7], MD4_K2,  5); \
+	MD4_STEP(G, c, d, a, b, X[11], MD4_K2,  9); MD4_STEP(G, b, c, d, a, X[15], MD4_K2, 13); \
+	\
+	MD4_STEP(H, a, b, c, d, X[ 0], MD4_K3,  3); MD4_STEP(H, d, a, b, c, X[ 8], MD4_K3,  9); \
+	MD4_STEP(H, c, d, a, b, X[ 4], MD4_K3, 11); MD4_STEP(H, b, c, d, a, X[12], MD4_K3, 15); \
+	MD4_STEP(H, a, b, c, d, X[ 2], MD4_K3,  3); MD4_STEP(H, d, a, b, c, X[10], MD4_K3,  9); \
+	MD4_STEP(H, c, d, a, b, X[ 6], MD4_K3, 11); MD4_STEP(H, b, c, d, a, X[14], MD4_K3, 15); \
+	MD4_STEP(H, a, b, c, d, X[ 1], MD4_K3,  3); MD4_STEP(H, d, a, b, c, X[ 9], MD4_K3,  9); \
+	MD4_STEP(H, c, d, a, b, X[ 5], MD4_K3, 11); MD4_STEP(H, b, c, d, a, X[13], MD4_K3, 15); \
+	MD4_STEP(H, a, b, c, d, X[ 3], MD4_K3,  3); MD4_STEP(H, d, a, b, c, X[11], MD4_K3,  9); \
+	MD4_STEP(H, c, d, a, b, X[ 7], MD4_K3, 11); MD4_STEP(H, b, c, d, a, X[15], MD4_K3, 15);
+
+
+static inline guint32
+hashfs_md4_load32 (const guchar *p)
+{
+	return (guint32) p[0] | ((guint32) p[1] << 8) |
+	       ((guint32) p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static inline void
+hashfs_md4_store32 (guchar *p, guint32 v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void
+hashfs_md4_compress (guint32 *state, const guchar *data, gsize blocks)
+{
+	guint32 a, b, c, d, X[16];
+
+	#define MD4_STEP(f, a, b, c, d, x, k, s) \
+		a = MD4_ROL(a + MD4_##f(b, c, d) + (x) + (k), s)
+
+	for (gsize n = 0; n < blocks; n++, data += 64) {
+		for (gint w = 0; w < 16; w++)
+			X[w] = hashfs_md4_load32(data + (w * 4));
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+
+		MD4_ROUNDS(a, b, c, d, X);
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	}
+
+	#undef MD4_STEP
+}
+
+/* Hash the rest of a message from a given state and append the
+   padding and bit length of the whole message */
+static void
+hashfs_md4_tail (guint32 *state, const guchar *data, gsize len,
+                 guint64 total, guchar *out)
+{
+	guchar pad[128];
+	gsize rest;
+
+	hashfs_md4_compress(state, data, len / 64);
+
+	rest = len % 64;
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, data + (len - rest), rest);
+	pad[rest] = 0x80;
+
+	rest = rest < 56 ? 64 : 128;
+
+	hashfs_md4_store32(pad + rest - 8, (guint32) (total << 3));
+	hashfs_md4_store32(pad + rest - 4, (guint32) (total >> 29));
+	hashfs_md4_compress(state, pad, rest / 64);
+
+	for (gint i = 0; i < 4; i++)
+		hashfs_md4_store32(out + (i * 4), state[i]);
+}
+
+static void
+hashfs_md4_scalar (guint32 *state, const guchar **data, gsize offset,
+                   gsize blocks)
+{
+	hashfs_md4_compress(state, data[0] + offset, blocks);
+}
+
+
+#ifdef HASHFS_MD4_X86
+
+/* Multi-buffer kernel: each vector lane carries the state of one
+   independent message, all lanes step through their blocks together.
+   State is laid out as a[lanes], b[lanes], c[lanes], d[lanes] */
+#define MD4_KERNEL(name, isa, vec, lanes) \
+__attribute__((target(isa))) static void \
+name (guint32 *state, const guchar **data, gsize offset, gsize blocks) \
+{ \
+	guint32 words[16][lanes] __attribute__((aligned(64))); \
+	vec a, b, c, d, aa, bb, cc, dd, X[16]; \
+	\
+	a = V_LOAD(state + (0 * lanes)); b = V_LOAD(state + (1 * lanes)); \
+	c = V_LOAD(state + (2 * lanes)); d = V_LOAD(state + (3 * lanes)); \
+	\
+	for (gsize n = 0; n < blocks; n++, offset += 64) { \
+		for (gint l = 0; l < lanes; l++) \
+			for (gint w = 0; w < 16; w++) \
+				words[w][l] = hashfs_md4_load32(data[l] + offset + (w * 4)); \
+		\
+		for (gint w = 0; w < 16; w++) \
+			X[w] = V_LOAD(words[w]); \
+		\
+		aa = a; bb = b; cc = c; dd = d; \
+		\
+		MD4_ROUNDS(a, b, c, d, X); \
+		\
+		a = V_ADD(a, aa); b = V_ADD(b, bb); c = V_ADD(c, cc); d = V_ADD(d, dd); \
+	} \
+	\
+	V_STORE(state + (0 * lanes), a); V_STORE(state + (1 * lanes), b); \
+	V_STORE(state + (2 * lanes), c); V_STORE(state + (3 * lanes), d); \
+}
+
+#define MD4_STEP(f, a, b, c, d, x, k, s) \
+	a = V_ROL(V_ADD(V_ADD(a, V_##f(b, c, d)), V_ADD(x, V_SET1(k))), s)
+
+#define V_F(x, y, z) V_XOR(z, V_AND(x, V_XOR(y, z)))
+#define V_G(x, y, z) V_OR(V_AND(x, y), V_AND(z, V_OR(x, y)))
+#define V_H(x, y, z) V_XOR(V_XOR(x, y), z)
+
+
+#define V_LOAD(p)     _mm_load_si128((const __m128i *) (p))
+#define V_STORE(p, v) _mm_store_si128((__m128i *) (p), v)
+#define V_SET1(k)     _mm_set1_epi32(k)
+#define V_ADD         _mm_add_epi32
+#define V_AND         _mm_and_si128
+#define V_OR          _mm_or_si128
+#define V_XOR         _mm_xor_si128
+#define V_ROL(x, s)   V_OR(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+
+MD4_KERNEL(hashfs_md4_sse2, "sse2", __m128i, 4)
+
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROL
+
+
+#define V_LOAD(p)     _mm256_load_si256((const __m256i *) (p))
+#define V_STORE(p, v) _mm256_store_si256((__m256i *) (p), v)
+#define V_SET1(k)     _mm256_set1_epi32(k)
+#define V_ADD         _mm256_add_epi32
+#define V_AND         _mm256_and_si256
+#define V_OR          _mm256_or_si256
+#define V_XOR         _mm256_xor_si256
+#define V_ROL(x, s)   V_OR(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+
+MD4_KERNEL(hashfs_md4_avx2, "avx2", __m256i, 8)
+
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROL
+
+
+#define V_LOAD(p)     _mm512_load_si512((const void *) (p))
+#define V_STORE(p, v) _mm512_store_si512((void *) (p), v)
+#define V_SET1(k)     _mm512_set1_epi32(k)
+#define V_ADD         _mm512_add_epi32
+#define V_AND         _mm512_and_si512
+#define V_OR          _mm512_or_si512
+#define V_XOR         _mm512_xor_si512
+#define V_ROL(x, s)   _mm512_rol_epi32(x, s)
+
+MD4_KERNEL(hashfs_md4_avx512, "avx512f", __m512i, 16)
+
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROL
+
+#undef MD4_STEP
+
+#endif
+
+
+/* Ordered from most to least preferred */
+static hashfs_md4_kernel_t kernels[] = {
+#ifdef HASHFS_MD4_X86
+	{ "avx512", "avx512f", 16, hashfs_md4_avx512 },
+	{ "avx2",   "avx2",     8, hashfs_md4_avx2 },
+	{ "sse2",   "sse2",     4, hashfs_md4_sse2 },
+#endif
+	{ "scalar", NULL,       1, hashfs_md4_scalar },
+};
+
+static hashfs_md4_kernel_t *kernel = &kernels[G_N_ELEMENTS(kernels) - 1];
+
+
+static gboolean
+hashfs_md4_kernel_supported (hashfs_md4_kernel_t *k)
+{
+	if (k->feature == NULL)
+		return TRUE;
+
+#ifdef HASHFS_MD4_X86
+	__builtin_cpu_init();
+
+	if (!g_strcmp0(k->feature, "avx512f"))
+		return __builtin_cpu_supports("avx512f");
+	else if (!g_strcmp0(k->feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	else if (!g_strcmp0(k->feature, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+
+	return FALSE;
+}
+
+/* Pick a kernel by name, or the widest one the CPU supports
+   when name is NULL or "auto" */
+gboolean
+hashfs_md4_set_kernel (const gchar *name)
+{
+	gboolean any = (name == NULL || !g_strcmp0(name, "auto"));
+
+	for (gint i = 0; i < G_N_ELEMENTS(kernels); i++) {
+		if (!any && g_strcmp0(name, kernels[i].name))
+			continue;
+
+		if (!hashfs_md4_kernel_supported(&kernels[i]))
+			continue;
+
+		kernel = &kernels[i];
+
+		HASHFS_DEBUG("Using %s MD4 kernel (%d lanes)", kernel->name, kernel->lanes);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+const gchar *
+hashfs_md4_kernel (void)
+{
+	return kernel->name;
+}
+
+gint
+hashfs_md4_lanes (void)
+{
+	return kernel->lanes;
+}
+
+void
+hashfs_md4 (const guchar *data, gsize len, guchar *out)
+{
+	guint32 state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+	hashfs_md4_tail(state, data, len, len, out);
+}
+
+/* Hash n independent messages, up to lanes of them at a time. The
+   shared whole-block prefix goes through the vector kernel, whatever
+   is left of each message is finished on its own */
+void
+hashfs_md4_multi (const guchar **data, const gsize *len, guchar **out, gint n)
+{
+	gint lanes = kernel->lanes;
+
+	for (gint first = 0; first < n; first += lanes) {
+		guint32 state[4 * HASHFS_MD4_MAX_LANES] __attribute__((aligned(64)));
+		const guchar *lane_data[HASHFS_MD4_MAX_LANES];
+		gint count = MIN(lanes, n - first);
+		gsize blocks = G_MAXSIZE;
+
+		if (count == 1 || lanes == 1) {
+			for (gint i = first; i < first + count; i++)
+				hashfs_md4(data[i], len[i], out[i]);
+
+			continue;
+		}
+
+		for (gint l = 0; l < lanes; l++) {
+			/* Idle lanes repeat the first message, their result is dropped */
+			gint i = first + (l < count ? l : 0);
+
+			lane_data[l] = data[i];
+			blocks = MIN(blocks, len[i] / 64);
+
+			state[(0 * lanes) + l] = 0x67452301;
+			state[(1 * lanes) + l] = 0xefcdab89;
+			state[(2 * lanes) + l] = 0x98badcfe;
+			state[(3 * lanes) + l] = 0x10325476;
+		}
+
+		kernel->func(state, lane_data, 0, blocks);
+
+		for (gint l = 0; l < count; l++) {
+			guint32 lane_state[4];
+			gint i = first + l;
+
+			for (gint s = 0; s < 4; s++)
+				lane_state[s] = state[(s * lanes) + l];
+
+			hashfs_md4_tail(lane_state, data[i] + (blocks * 64),
+			                len[i] - (blocks * 64), len[i], out[i]);
+		}
+	}
+}
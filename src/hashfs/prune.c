@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "hashfs.h"
+
+/* Paths handed to a thread at a time */
+#define PRUNE_BATCH 256
+
+typedef enum {
+	HASHFS_PRUNE_ALIVE,
+	HASHFS_PRUNE_GONE,
+
+	/* Couldn't be read, or its filesystem isn't mounted */
+	HASHFS_PRUNE_UNREACHABLE,
+} hashfs_prune_state_t;
+
+/* A file entry whose path is checked, and the sets it refers to */
+typedef struct hashfs_prune_file_St {
+	gchar *pkey;
+	gchar *path;
+	GList *sets;
+
+	/* Device from hashfs:stat, if the file was ever hashed */
+	gboolean has_dev;
+	guint64 dev;
+
+	hashfs_prune_state_t state;
+} hashfs_prune_file_t;
+
+typedef struct hashfs_prune_batch_St {
+	hashfs_prune_file_t **files;
+	gint n;
+} hashfs_prune_batch_t;
+
+struct hashfs_prune_St {
+	/* Only entries below these paths are checked, every one without */
+	GList *paths;
+	gboolean dry_run;
+
+	GPtrArray *files;
+
+	/* Set pkeys some entry that stays refers to */
+	GHashTable *refs;
+};
+
+
+static void
+hashfs_prune_file_free (gpointer data)
+{
+	hashfs_prune_file_t *file = data;
+
+	g_free(file->pkey);
+	g_free(file->path);
+	g_list_free_full(file->sets, g_free);
+	g_free(file);
+}
+
+static gboolean
+hashfs_prune_under (hashfs_prune_t *prune, const gchar *path)
+{
+	const gchar *dir;
+	gsize len;
+
+	if (!prune->paths)
+		return TRUE;
+
+	for (GList *item = prune->paths; item; item = g_list_next(item)) {
+		dir = item->data;
+		len = strlen(dir);
+
+		if (!strncmp(path, dir, len) && (path[len] == '\0' || path[len] == G_DIR_SEPARATOR || dir[len - 1] == G_DIR_SEPARATOR))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Files refer to the sets they are in by a column named after the set
+   type, holding the set's pkey */
+static void
+hashfs_prune_set_ref (const gchar *key, const gchar *value, gpointer data)
+{
+	GList **sets = data;
+
+	if (g_str_has_prefix(value, "set:"))
+		*sets = g_list_prepend(*sets, g_strdup(value));
+}
+
+static void
+hashfs_prune_keep (hashfs_prune_t *prune, GList *sets)
+{
+	for (GList *item = sets; item; item = g_list_next(item))
+		g_hash_table_replace(prune->refs, g_strdup(item->data), NULL);
+}
+
+/* Whether a file that isn't at its path any more is really gone. A
+   path on a filesystem that isn't mounted looks missing as well, so
+   the nearest directory still there has to be on the device the file
+   was hashed on. Files never hashed only count as gone from a
+   directory that is still there */
+static hashfs_prune_state_t
+hashfs_prune_check (hashfs_prune_file_t *file)
+{
+	struct stat info;
+	gchar *dir, *parent;
+	hashfs_prune_state_t state;
+
+	if (g_stat(file->path, &info) == 0)
+		return HASHFS_PRUNE_ALIVE;
+
+	if (errno != ENOENT && errno != ENOTDIR)
+		return HASHFS_PRUNE_UNREACHABLE;
+
+	dir = g_path_get_dirname(file->path);
+
+	if (!file->has_dev) {
+		state = g_stat(dir, &info) == 0 ? HASHFS_PRUNE_GONE : HASHFS_PRUNE_UNREACHABLE;
+		g_free(dir);
+
+		return state;
+	}
+
+	while (g_stat(dir, &info) != 0) {
+		parent = g_path_get_dirname(dir);
+
+		if (!g_strcmp0(parent, dir)) {
+			g_free(parent);
+			g_free(dir);
+
+			return HASHFS_PRUNE_UNREACHABLE;
+		}
+
+		g_free(dir);
+		dir = parent;
+	}
+
+	state = (guint64) info.st_dev == file->dev ? HASHFS_PRUNE_GONE : HASHFS_PRUNE_UNREACHABLE;
+
+	g_free(dir);
+
+	return state;
+}
+
+static void
+hashfs_prune_worker (gpointer data, gpointer user_data)
+{
+	hashfs_prune_batch_t *batch = data;
+
+	for (gint i = 0; i < batch->n; i++)
+		batch->files[i]->state = hashfs_prune_check(batch->files[i]);
+
+	g_free(batch);
+}
+
+/* Read every file entry, the ones outside the paths given only for
+   the sets they keep */
+static void
+hashfs_prune_load (hashfs_prune_t *prune)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	hashfs_prune_file_t *file;
+	const gchar *path, *val;
+	GList *sets;
+	gchar *end;
+
+	query = hashfs_db_query_new("pkey.BeginsWith(file:)");
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result); i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+		sets = NULL;
+
+		hashfs_db_entry_foreach(entry, hashfs_prune_set_ref, &sets);
+
+		if (!hashfs_db_entry_lookup(entry, "path", &path) || !hashfs_prune_under(prune, path)) {
+			hashfs_prune_keep(prune, sets);
+			g_list_free_full(sets, g_free);
+			hashfs_db_entry_destroy(entry);
+
+			continue;
+		}
+
+		file = g_new0(hashfs_prune_file_t, 1);
+		file->pkey = g_strdup(hashfs_db_entry_pkey(entry));
+		file->path = g_strdup(path);
+		file->sets = sets;
+
+		if (hashfs_db_entry_lookup(entry, "hashfs:stat", &val) && *val) {
+			file->dev = g_ascii_strtoull(val, &end, 10);
+			file->has_dev = *end == ':';
+		}
+
+		g_ptr_array_add(prune->files, file);
+
+		hashfs_db_entry_destroy(entry);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+}
+
+/* Stat the paths on hashfs.prune_threads threads, most of the time
+   goes to waiting on the disk or the network */
+static void
+hashfs_prune_stat (hashfs_prune_t *prune)
+{
+	hashfs_prune_batch_t *batch;
+	GThreadPool *pool;
+	gint threads;
+
+	threads = MAX(hashfs_config_property_lookup_int("hashfs", "prune_threads"), 1);
+	pool = g_thread_pool_new(hashfs_prune_worker, NULL, threads, TRUE, NULL);
+
+	for (guint i = 0; i < prune->files->len; i += PRUNE_BATCH) {
+		batch = g_new0(hashfs_prune_batch_t, 1);
+		batch->files = (hashfs_prune_file_t **) prune->files->pdata + i;
+		batch->n = MIN(PRUNE_BATCH, prune->files->len - i);
+
+		g_thread_pool_push(pool, batch, NULL);
+	}
+
+	g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+static gboolean
+hashfs_prune_remove (const gchar *pkey)
+{
+	hashfs_db_entry_t *entry;
+	gboolean rval;
+
+	entry = hashfs_db_entry_new_from_key(pkey);
+	rval = hashfs_db_entry_remove(entry);
+	hashfs_db_entry_destroy(entry);
+
+	hashfs_db_tran_commit();
+
+	return rval;
+}
+
+/* Drop the sets no file refers to any more */
+static gint
+hashfs_prune_sets (hashfs_prune_t *prune)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	gchar *pkey;
+	gint removed = 0;
+
+	query = hashfs_db_query_new("pkey.BeginsWith(set:)");
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result); i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+		pkey = g_strdup(hashfs_db_entry_pkey(entry));
+		hashfs_db_entry_destroy(entry);
+
+		if (!g_hash_table_contains(prune->refs, pkey)) {
+			HASHFS_DEBUG("Set (%s) no longer used", pkey);
+
+			if (prune->dry_run || hashfs_prune_remove(pkey))
+				removed++;
+		}
+
+		g_free(pkey);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+
+	return removed;
+}
+
+/* Removes the entries of files that are gone, and then the sets no
+   file is in */
+hashfs_prune_t *
+hashfs_prune_new (gboolean dry_run)
+{
+	hashfs_prune_t *prune;
+
+	prune = g_new0(hashfs_prune_t, 1);
+	prune->dry_run = dry_run;
+	prune->files = g_ptr_array_new_with_free_func(hashfs_prune_file_free);
+	prune->refs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	return prune;
+}
+
+/* Paths are matched against the ones stored as text, so they are made
+   canonical first */
+void
+hashfs_prune_add (hashfs_prune_t *prune, const gchar *path)
+{
+	prune->paths = g_list_append(prune->paths, hashfs_canonical_path(path));
+}
+
+/* Calls func for every file that is gone */
+void
+hashfs_prune_run (hashfs_prune_t *prune, hashfs_prune_func func, gpointer data)
+{
+	hashfs_prune_file_t *file;
+	gint gone = 0, unreachable = 0, sets;
+
+	hashfs_prune_load(prune);
+	hashfs_prune_stat(prune);
+
+	for (guint i = 0; i < prune->files->len; i++) {
+		file = g_ptr_array_index(prune->files, i);
+
+		switch (file->state) {
+		case HASHFS_PRUNE_GONE:
+			if (func)
+				func(file->path, data);
+
+			if (prune->dry_run || hashfs_prune_remove(file->pkey))
+				gone++;
+			break;
+		case HASHFS_PRUNE_UNREACHABLE:
+			unreachable++;
+			/* fall through */
+		case HASHFS_PRUNE_ALIVE:
+			hashfs_prune_keep(prune, file->sets);
+			break;
+		}
+	}
+
+	sets = hashfs_prune_sets(prune);
+
+	hashfs_db_tran_flush();
+
+	HASHFS_LOG("Checked %u files: %d gone, %d kept on filesystems that couldn't be read",
+	           prune->files->len, gone, unreachable);
+	HASHFS_LOG("%d sets no longer used", sets);
+}
+
+void
+hashfs_prune_destroy (hashfs_prune_t *prune)
+{
+	g_ptr_array_free(prune->files, TRUE);
+	g_hash_table_destroy(prune->refs);
+	g_list_free_full(prune->paths, g_free);
+
+	g_free(prune);
+}
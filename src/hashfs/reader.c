@@ -0,0 +1,622 @@
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _LARGE_FILES 1
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "hashfs.h"
+
+/* How much of the next file to ask the kernel for
+   while the current one is finishing */
+#define PREFETCH_SIZE (4 * HASHFS_ED2K_BLOCKSIZE)
+
+struct hashfs_reader_ring_St;
+
+typedef struct hashfs_reader_req_St {
+	hashfs_block_t *block;
+	gint res;
+	gboolean complete;
+} hashfs_reader_req_t;
+
+struct hashfs_reader_St {
+	gint fd;
+	gchar *filename;
+	gint64 size;
+
+	/* Next block to read, or with io_uring, to submit */
+	gint64 offset;
+	gint index;
+	gboolean failed;
+
+	/* Set when fewer blocks are allocated than the size needs. The
+	   last hole looked up spans hole_start to hole_end */
+	gboolean sparse;
+	gint64 hole_start;
+	gint64 hole_end;
+
+	/* NULL when reading with plain blocking preads */
+	struct hashfs_reader_ring_St *ring;
+	GQueue inflight;
+};
+
+
+static gboolean drop_cache;
+
+/* Per thread, each thread reads its own files */
+static GPrivate next_key = G_PRIVATE_INIT(g_free);
+
+
+static gchar *
+hashfs_reader_take_next (void)
+{
+	gchar *filename;
+
+	filename = g_private_get(&next_key);
+	g_private_set(&next_key, NULL);
+
+	return filename;
+}
+
+static gboolean
+hashfs_reader_pread (gint fd, guchar *buf, gsize len, gint64 offset)
+{
+	gssize n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		/* Errors, or the file shrunk under us */
+		if (n <= 0)
+			return FALSE;
+
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return TRUE;
+}
+
+static void
+hashfs_reader_done (hashfs_reader_t *reader, hashfs_block_t *block)
+{
+	/* We have our own copy, don't let a library scan
+	   push everything else out of the page cache */
+	if (drop_cache && !block->zero)
+		posix_fadvise(reader->fd, block->offset, block->len, POSIX_FADV_DONTNEED);
+}
+
+/* TRUE if the block at offset lies entirely in a hole, so it reads
+   back as zeros without us reading it. Costs one lseek per hole
+   rather than one per block */
+static gboolean
+hashfs_reader_hole (hashfs_reader_t *reader, gint64 offset, gsize len)
+{
+	off_t data;
+
+	if (!reader->sparse)
+		return FALSE;
+
+	if (offset >= reader->hole_start && offset + len <= reader->hole_end)
+		return TRUE;
+
+	if ((data = lseek(reader->fd, offset, SEEK_DATA)) < 0) {
+		/* No data left past offset */
+		if (errno == ENXIO) {
+			data = reader->size;
+		} else {
+			reader->sparse = FALSE;
+
+			return FALSE;
+		}
+	}
+
+	reader->hole_start = offset;
+	reader->hole_end = data;
+
+	return data >= offset + (gint64) len;
+}
+
+static hashfs_reader_t *
+hashfs_reader_open (const gchar *filename, gint64 size,
+                    struct hashfs_reader_ring_St *ring)
+{
+	hashfs_reader_t *reader;
+	struct stat info;
+	gint fd;
+
+	if ((fd = g_open(filename, O_RDONLY, 0)) < 0) {
+		HASHFS_DEBUG("Failed to open file (%s)", filename);
+
+		return NULL;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	reader = g_new0(hashfs_reader_t, 1);
+	reader->fd = fd;
+	reader->filename = g_strdup(filename);
+	reader->size = size;
+	reader->ring = ring;
+
+	if (fstat(fd, &info) == 0)
+		reader->sparse = (gint64) info.st_blocks * 512 < size;
+
+	g_queue_init(&reader->inflight);
+
+	return reader;
+}
+
+
+#ifdef HAVE_LIBURING
+
+/* One ring per hashing thread, shared by the file being read and the
+   head of the next one, which is read in once the current file has
+   no more blocks to submit */
+typedef struct hashfs_reader_ring_St {
+	struct io_uring uring;
+	gboolean broken;
+	hashfs_reader_t *prefetched;
+} hashfs_reader_ring_t;
+
+static void hashfs_reader_ring_free (gpointer data);
+
+static GPrivate ring_key = G_PRIVATE_INIT(hashfs_reader_ring_free);
+static gboolean use_uring;
+static gint depth;
+
+
+static hashfs_reader_ring_t *
+hashfs_reader_ring_get (void)
+{
+	hashfs_reader_ring_t *ring;
+	gint rval;
+
+	if (!use_uring)
+		return NULL;
+
+	if ((ring = g_private_get(&ring_key)) == NULL) {
+		ring = g_new0(hashfs_reader_ring_t, 1);
+
+		if ((rval = io_uring_queue_init(depth * 2, &ring->uring, 0)) < 0) {
+			HASHFS_DEBUG("io_uring not available (%s), using blocking reads",
+			             g_strerror(-rval));
+
+			ring->broken = TRUE;
+		}
+
+		g_private_set(&ring_key, ring);
+	}
+
+	return ring->broken ? NULL : ring;
+}
+
+static void
+hashfs_reader_ring_reap (hashfs_reader_ring_t *ring, hashfs_reader_req_t *want)
+{
+	struct io_uring_cqe *cqe;
+	hashfs_reader_req_t *req;
+	gint rval;
+
+	/* Completions for other requests on the ring are
+	   recorded on their request as they go by */
+	while (!want->complete) {
+		rval = io_uring_wait_cqe(&ring->uring, &cqe);
+
+		if (rval == -EINTR)
+			continue;
+
+		if (rval < 0) {
+			want->res = rval;
+			want->complete = TRUE;
+
+			break;
+		}
+
+		req = io_uring_cqe_get_data(cqe);
+		req->res = cqe->res;
+		req->complete = TRUE;
+
+		io_uring_cqe_seen(&ring->uring, cqe);
+	}
+}
+
+static gboolean
+hashfs_reader_submit (hashfs_reader_t *reader, gboolean wait)
+{
+	hashfs_reader_req_t *req;
+	hashfs_block_t *block;
+	struct io_uring_sqe *sqe;
+	gsize len;
+
+	if (reader->failed || reader->offset >= reader->size)
+		return FALSE;
+
+	len = MIN(HASHFS_ED2K_BLOCKSIZE, reader->size - reader->offset);
+
+	/* Nothing to read, the request is complete as it's queued */
+	if (hashfs_reader_hole(reader, reader->offset, len)) {
+		req = g_new0(hashfs_reader_req_t, 1);
+		req->block = hashfs_block_zero(reader->index, reader->offset, len);
+		req->res = len;
+		req->complete = TRUE;
+
+		g_queue_push_tail(&reader->inflight, req);
+
+		reader->offset += len;
+		reader->index++;
+
+		return TRUE;
+	}
+
+	if (wait)
+		block = hashfs_block_new(reader->index, reader->offset, len);
+	else
+		block = hashfs_block_try_new(reader->index, reader->offset, len);
+
+	if (!block)
+		return FALSE;
+
+	if (!(sqe = io_uring_get_sqe(&reader->ring->uring))) {
+		hashfs_block_unref(block);
+
+		return FALSE;
+	}
+
+	req = g_new0(hashfs_reader_req_t, 1);
+	req->block = block;
+
+	io_uring_prep_read(sqe, reader->fd, block->data, len, reader->offset);
+	io_uring_sqe_set_data(sqe, req);
+
+	g_queue_push_tail(&reader->inflight, req);
+
+	reader->offset += len;
+	reader->index++;
+
+	return TRUE;
+}
+
+static void
+hashfs_reader_prefetch (hashfs_reader_ring_t *ring, gint slots)
+{
+	hashfs_reader_t *next;
+	gchar *filename;
+	struct stat info;
+
+	if (ring->prefetched || !(filename = hashfs_reader_take_next()))
+		return;
+
+	if (g_stat(filename, &info) == 0 && info.st_size > 0 &&
+	    (next = hashfs_reader_open(filename, info.st_size, ring))) {
+		HASHFS_DEBUG("Prefetching %s", filename);
+
+		while (slots-- > 0 && hashfs_reader_submit(next, FALSE));
+
+		ring->prefetched = next;
+	}
+
+	g_free(filename);
+}
+
+/* Keep up to depth reads in flight, spilling over into the next file
+   once this one is fully queued. Never waits for a buffer unless
+   nothing is in flight, so buffers held by our own unreaped reads
+   can't deadlock us */
+static void
+hashfs_reader_fill (hashfs_reader_t *reader)
+{
+	hashfs_reader_ring_t *ring = reader->ring;
+
+	if (g_queue_is_empty(&reader->inflight))
+		hashfs_reader_submit(reader, TRUE);
+
+	while (g_queue_get_length(&reader->inflight) < depth &&
+	       hashfs_reader_submit(reader, FALSE));
+
+	if (reader->offset >= reader->size &&
+	    g_queue_get_length(&reader->inflight) < depth)
+		hashfs_reader_prefetch(ring, depth - g_queue_get_length(&reader->inflight));
+
+	io_uring_submit(&ring->uring);
+}
+
+static hashfs_block_t *
+hashfs_reader_next_uring (hashfs_reader_t *reader)
+{
+	hashfs_reader_req_t *req;
+	hashfs_block_t *block;
+
+	if (reader->failed)
+		return NULL;
+
+	hashfs_reader_fill(reader);
+
+	if (!(req = g_queue_pop_head(&reader->inflight)))
+		return NULL;
+
+	hashfs_reader_ring_reap(reader->ring, req);
+
+	block = req->block;
+
+	/* Finish short reads the slow way */
+	if (req->res < 0 || (req->res < block->len &&
+	    !hashfs_reader_pread(reader->fd, block->data + req->res,
+	                         block->len - req->res, block->offset + req->res))) {
+		HASHFS_DEBUG("Failed to read block %d of %s", block->index, reader->filename);
+
+		hashfs_block_unref(block);
+		reader->failed = TRUE;
+		block = NULL;
+	}
+
+	g_free(req);
+
+	if (block)
+		hashfs_reader_done(reader, block);
+
+	return block;
+}
+
+static void
+hashfs_reader_drain (hashfs_reader_t *reader)
+{
+	hashfs_reader_req_t *req;
+
+	while ((req = g_queue_pop_head(&reader->inflight))) {
+		hashfs_reader_ring_reap(reader->ring, req);
+		hashfs_block_unref(req->block);
+
+		g_free(req);
+	}
+}
+
+static void
+hashfs_reader_ring_free (gpointer data)
+{
+	hashfs_reader_ring_t *ring = data;
+
+	if (ring->prefetched)
+		hashfs_reader_destroy(ring->prefetched);
+
+	if (!ring->broken)
+		io_uring_queue_exit(&ring->uring);
+
+	g_free(ring);
+}
+
+#else
+
+typedef struct hashfs_reader_ring_St hashfs_reader_ring_t;
+
+#define hashfs_reader_ring_get() NULL
+#define hashfs_reader_next_uring(reader) NULL
+#define hashfs_reader_drain(reader)
+
+#endif
+
+
+/* engine is auto, which tries io_uring, sync or io_uring. Anything
+   else reads blocking */
+void
+hashfs_readers_init (gboolean dropcache, const gchar *engine, gint iodepth)
+{
+	gboolean uring;
+
+	drop_cache = dropcache;
+
+	uring = !g_strcmp0(engine, "auto") || !g_strcmp0(engine, "io_uring");
+
+	if (!uring && g_strcmp0(engine, "sync") != 0)
+		HASHFS_LOG("Unknown io engine %s, using blocking reads", engine);
+
+#ifdef HAVE_LIBURING
+	use_uring = uring;
+	depth = MAX(iodepth, 1);
+#else
+	if (!g_strcmp0(engine, "io_uring"))
+		HASHFS_LOG("Built without io_uring support, using blocking reads");
+#endif
+}
+
+void
+hashfs_readers_destroy (void)
+{
+#ifdef HAVE_LIBURING
+	g_private_replace(&ring_key, NULL);
+#endif
+
+	g_private_replace(&next_key, NULL);
+}
+
+/* Reads in flight per file, lowered while several files are being
+   read at once so they share the buffer pool */
+void
+hashfs_readers_set_depth (gint iodepth)
+{
+#ifdef HAVE_LIBURING
+	depth = MAX(iodepth, 1);
+#endif
+}
+
+/* Tell the reader which file this thread will hash after the current
+   one, so its head can be read in while the current file finishes */
+void
+hashfs_reader_set_next (const gchar *filename)
+{
+	g_private_replace(&next_key, g_strdup(filename));
+}
+
+static void
+hashfs_reader_prefetch_next (void)
+{
+	gchar *filename;
+	gint fd;
+
+	if (!(filename = hashfs_reader_take_next()))
+		return;
+
+	if ((fd = g_open(filename, O_RDONLY, 0)) >= 0) {
+		HASHFS_DEBUG("Prefetching %s", filename);
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+
+		close(fd);
+	}
+
+	g_free(filename);
+}
+
+hashfs_reader_t *
+hashfs_reader_new (const gchar *filename, gint64 size)
+{
+	hashfs_reader_ring_t *ring;
+
+	ring = hashfs_reader_ring_get();
+
+#ifdef HAVE_LIBURING
+	/* Pick up the reads already in flight for this file */
+	if (ring && ring->prefetched) {
+		hashfs_reader_t *reader = ring->prefetched;
+
+		ring->prefetched = NULL;
+
+		if (!g_strcmp0(reader->filename, filename) && reader->size == size)
+			return reader;
+
+		hashfs_reader_destroy(reader);
+	}
+#endif
+
+	return hashfs_reader_open(filename, size, ring);
+}
+
+/* Read the next block into a recycled buffer. Returns NULL at the end
+   of the file, check hashfs_reader_failed() to tell errors from EOF */
+hashfs_block_t *
+hashfs_reader_next (hashfs_reader_t *reader)
+{
+	hashfs_block_t *block;
+	gsize len;
+
+	if (reader->ring)
+		return hashfs_reader_next_uring(reader);
+
+	if (reader->failed || reader->offset >= reader->size)
+		return NULL;
+
+	len = MIN(HASHFS_ED2K_BLOCKSIZE, reader->size - reader->offset);
+
+	if (hashfs_reader_hole(reader, reader->offset, len))
+		block = hashfs_block_zero(reader->index, reader->offset, len);
+	else
+		block = hashfs_block_new(reader->index, reader->offset, len);
+
+	if (!block) {
+		reader->failed = TRUE;
+
+		return NULL;
+	}
+
+	if (!block->zero && !hashfs_reader_pread(reader->fd, block->data, len, reader->offset)) {
+		HASHFS_DEBUG("Failed to read block %d of %s", reader->index, reader->filename);
+
+		hashfs_block_unref(block);
+		reader->failed = TRUE;
+
+		return NULL;
+	}
+
+	hashfs_reader_done(reader, block);
+
+	reader->offset += len;
+	reader->index++;
+
+	if (reader->offset >= reader->size)
+		hashfs_reader_prefetch_next();
+
+	return block;
+}
+
+/* Continue reading from block index, dropping any reads in flight */
+void
+hashfs_reader_seek (hashfs_reader_t *reader, gint index)
+{
+	if (reader->ring)
+		hashfs_reader_drain(reader);
+
+	reader->index = index;
+	reader->offset = MIN((gint64) index * HASHFS_ED2K_BLOCKSIZE, reader->size);
+}
+
+/* Read a single block with no read-ahead, for checking a few blocks
+   out of a large file. Doesn't move the sequential position */
+hashfs_block_t *
+hashfs_reader_read (hashfs_reader_t *reader, gint index)
+{
+	hashfs_block_t *block;
+	gint64 offset;
+	gsize len;
+
+	offset = (gint64) index * HASHFS_ED2K_BLOCKSIZE;
+
+	if (index < 0 || offset >= reader->size)
+		return NULL;
+
+	len = MIN(HASHFS_ED2K_BLOCKSIZE, reader->size - offset);
+
+	if (hashfs_reader_hole(reader, offset, len))
+		return hashfs_block_zero(index, offset, len);
+
+	if (!(block = hashfs_block_new(index, offset, len)))
+		return NULL;
+
+	if (!hashfs_reader_pread(reader->fd, block->data, len, offset)) {
+		HASHFS_DEBUG("Failed to read block %d of %s", index, reader->filename);
+
+		hashfs_block_unref(block);
+
+		return NULL;
+	}
+
+	hashfs_reader_done(reader, block);
+
+	return block;
+}
+
+gboolean
+hashfs_reader_failed (hashfs_reader_t *reader)
+{
+	return reader->failed;
+}
+
+void
+hashfs_reader_destroy (hashfs_reader_t *reader)
+{
+	if (reader->ring)
+		hashfs_reader_drain(reader);
+
+	close(reader->fd);
+
+	g_free(reader->filename);
+	g_free(reader);
+}
@@ -0,0 +1,576 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+/* A queued file and the digests the ones that added it need */
+typedef struct hashfs_sched_item_St {
+	hashfs_file_t *file;
+	gint types;
+
+	/* Where it starts on its device, for hashing in disk order */
+	guint64 physical;
+	guint64 inode;
+} hashfs_sched_item_t;
+
+/* Files queued on one device, biggest first or in the order they are
+   laid out on it */
+typedef struct hashfs_sched_dev_St {
+	dev_t dev;
+	gint limit;
+	gint active;
+	GSequence *files;
+
+	/* Whether the filesystem tells where files are. Without that,
+	   files are taken by inode */
+	gboolean fiemap;
+} hashfs_sched_dev_t;
+
+/* Sent from the hashing threads to the thread running the scheduler,
+   hashes is only set for checkpoints */
+typedef struct hashfs_sched_msg_St {
+	hashfs_file_t *file;
+	guchar *hashes;
+	gint blocks;
+} hashfs_sched_msg_t;
+
+struct hashfs_sched_St {
+	/* Take the digests of files with the same quick fingerprint */
+	gboolean copies;
+
+	/* Hash files in the order they are on disk, set by hashfs.hash_order */
+	gboolean disk_order;
+
+	/* Files a device holds on to before hashing the first of them,
+	   set by hashfs.hash_window. Files added later only go ahead of
+	   the ones still waiting */
+	gint window;
+
+	/* Files added, and the ones waiting on a device */
+	GList *devs;
+	gint queued;
+	gint waiting;
+
+	/* Hashing threads, started for the devices as they come up once
+	   the scheduler runs. They stop once it is closed and no file is
+	   left */
+	GPtrArray *threads;
+	gint streams;
+	gboolean running;
+	gboolean closed;
+
+	GMutex lock;
+	GCond cond;
+	GAsyncQueue *done;
+};
+
+static gchar sched_end;
+
+
+/* Spinning disks only ever get slower with more than one reader,
+   anything we can't tell apart is treated like one */
+static gboolean
+hashfs_sched_rotational (dev_t dev)
+{
+	gchar *path, *contents;
+	gboolean rval = TRUE;
+
+	path = g_strdup_printf("/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+
+	/* Partitions share the queue of their disk */
+	if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+		g_free(path);
+		path = g_strdup_printf("/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+
+		if (!g_file_get_contents(path, &contents, NULL, NULL))
+			contents = NULL;
+	}
+
+	if (contents)
+		rval = atoi(contents) != 0;
+
+	g_free(contents);
+	g_free(path);
+
+	return rval;
+}
+
+/* Called with the lock held */
+static hashfs_sched_dev_t *
+hashfs_sched_dev_get (hashfs_sched_t *sched, dev_t dev)
+{
+	hashfs_sched_dev_t *sdev;
+	GList *item;
+
+	for (item = sched->devs; item; item = g_list_next(item)) {
+		sdev = item->data;
+
+		if (sdev->dev == dev)
+			return sdev;
+	}
+
+	sdev = g_new0(hashfs_sched_dev_t, 1);
+	sdev->dev = dev;
+	sdev->files = g_sequence_new(NULL);
+	sdev->fiemap = TRUE;
+
+	if (hashfs_sched_rotational(dev))
+		sdev->limit = hashfs_config_property_lookup_int("hashfs", "streams_rotational");
+	else
+		sdev->limit = hashfs_config_property_lookup_int("hashfs", "streams_solid");
+
+	sdev->limit = MAX(sdev->limit, 1);
+
+	HASHFS_DEBUG("Device %u:%u hashed with up to %d streams", major(dev), minor(dev), sdev->limit);
+
+	sched->devs = g_list_append(sched->devs, sdev);
+
+	return sdev;
+}
+
+static gint
+hashfs_sched_cmp (gconstpointer a, gconstpointer b, gpointer data)
+{
+	const hashfs_sched_item_t *ia = a, *ib = b;
+
+	if (ia->file->size == ib->file->size)
+		return 0;
+
+	return ia->file->size < ib->file->size ? 1 : -1;
+}
+
+/* Files without a known position go last, in inode order. Those are
+   all of them on filesystems without FIEMAP */
+static gint
+hashfs_sched_cmp_disk (gconstpointer a, gconstpointer b, gpointer data)
+{
+	const hashfs_sched_item_t *ia = a, *ib = b;
+
+	if (ia->physical != ib->physical)
+		return ia->physical < ib->physical ? -1 : 1;
+
+	if (ia->inode == ib->inode)
+		return 0;
+
+	return ia->inode < ib->inode ? -1 : 1;
+}
+
+/* Physical offset of the first extent of a file, G_MAXUINT64 if it has
+   none on disk yet. Filesystems without FIEMAP turn it off for the
+   whole device */
+static guint64
+hashfs_sched_physical (hashfs_sched_dev_t *sdev, const gchar *filename)
+{
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} req;
+	guint64 physical = G_MAXUINT64;
+	gint fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return physical;
+
+	memset(&req, 0, sizeof(req));
+	req.map.fm_length = FIEMAP_MAX_OFFSET;
+	req.map.fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &req.map) == 0) {
+		if (req.map.fm_mapped_extents > 0 &&
+		    !(req.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)))
+			physical = req.extent.fe_physical;
+	} else if (errno == ENOTTY || errno == EOPNOTSUPP || errno == EINVAL) {
+		HASHFS_DEBUG("Device %u:%u has no FIEMAP, hashing in inode order",
+		             major(sdev->dev), minor(sdev->dev));
+
+		g_atomic_int_set(&sdev->fiemap, FALSE);
+	}
+
+	close(fd);
+
+	return physical;
+}
+
+static void
+hashfs_sched_position (hashfs_sched_dev_t *sdev, hashfs_sched_item_t *item,
+                       struct stat *info)
+{
+	item->inode = info->st_ino;
+	item->physical = g_atomic_int_get(&sdev->fiemap) ? hashfs_sched_physical(sdev, item->file->filename) : G_MAXUINT64;
+}
+
+static void
+hashfs_sched_item_free (hashfs_sched_item_t *item)
+{
+	hashfs_file_destroy(item->file);
+	g_free(item);
+}
+
+/* Called from the hashing threads, which never touch the database
+   themselves. The thread running the scheduler stores the hashes */
+static void
+hashfs_sched_checkpoint (hashfs_file_t *file, const guchar *hashes, gint blocks,
+                         gpointer data)
+{
+	hashfs_sched_t *sched = data;
+	hashfs_sched_msg_t *msg;
+
+	msg = g_new0(hashfs_sched_msg_t, 1);
+	msg->file = file;
+	msg->hashes = g_memdup(hashes, blocks * 16);
+	msg->blocks = blocks;
+
+	g_async_queue_push(sched->done, msg);
+}
+
+/* The device with the fewest streams running that has room for one
+   more and a full window, starting on its biggest file. Called with
+   the lock held */
+static hashfs_sched_item_t *
+hashfs_sched_next (hashfs_sched_t *sched, hashfs_sched_dev_t **out)
+{
+	hashfs_sched_dev_t *sdev, *best = NULL;
+	hashfs_sched_item_t *next;
+	GSequenceIter *iter;
+	GList *item;
+
+	for (item = sched->devs; item; item = g_list_next(item)) {
+		sdev = item->data;
+
+		if (g_sequence_is_empty(sdev->files) || sdev->active >= sdev->limit)
+			continue;
+
+		if (!sched->closed && g_sequence_get_length(sdev->files) < sched->window)
+			continue;
+
+		if (!best || sdev->active < best->active)
+			best = sdev;
+	}
+
+	if (!best)
+		return NULL;
+
+	iter = g_sequence_get_begin_iter(best->files);
+	next = g_sequence_get(iter);
+	g_sequence_remove(iter);
+
+	best->active++;
+	sched->waiting--;
+	*out = best;
+
+	return next;
+}
+
+static gpointer
+hashfs_sched_worker (gpointer data)
+{
+	hashfs_sched_t *sched = data;
+	hashfs_sched_dev_t *sdev;
+	hashfs_sched_item_t *item, *next;
+	hashfs_sched_msg_t *msg;
+	GSequenceIter *iter;
+
+	g_mutex_lock(&sched->lock);
+
+	for (;;) {
+		if (!(item = hashfs_sched_next(sched, &sdev))) {
+			if (sched->closed && sched->waiting == 0)
+				break;
+
+			g_cond_wait(&sched->cond, &sched->lock);
+
+			continue;
+		}
+
+		/* Most likely this thread's next file on the device */
+		iter = g_sequence_get_begin_iter(sdev->files);
+		next = g_sequence_iter_is_end(iter) ? NULL : g_sequence_get(iter);
+		hashfs_reader_set_next(next ? next->file->filename : NULL);
+
+		g_mutex_unlock(&sched->lock);
+
+		hashfs_file_hash(item->file, item->types);
+
+		msg = g_new0(hashfs_sched_msg_t, 1);
+		msg->file = item->file;
+		g_free(item);
+
+		g_async_queue_push(sched->done, msg);
+
+		g_mutex_lock(&sched->lock);
+
+		/* A stream is free on the device, and the last file may be
+		   gone for the threads waiting */
+		sdev->active--;
+		g_cond_broadcast(&sched->cond);
+	}
+
+	g_mutex_unlock(&sched->lock);
+
+	return NULL;
+}
+
+/* Start threads for the streams of every device up so far, as many as
+   there are buffers for. Called with the lock held */
+static void
+hashfs_sched_spawn (hashfs_sched_t *sched)
+{
+	GList *item;
+	gint streams = 0;
+
+	if (!sched->running || !sched->devs)
+		return;
+
+	for (item = sched->devs; item; item = g_list_next(item))
+		streams += ((hashfs_sched_dev_t *) item->data)->limit;
+
+	if (streams == sched->streams)
+		return;
+
+	sched->streams = streams;
+	streams = hashfs_hash_streams(streams);
+
+	while ((gint) sched->threads->len < streams)
+		g_ptr_array_add(sched->threads, g_thread_new("hashfs-sched", hashfs_sched_worker, sched));
+}
+
+/* Store a checkpoint under the entry of a file that's still being
+   hashed, unless the file changed in the meantime */
+static void
+hashfs_sched_store (hashfs_sched_msg_t *msg)
+{
+	hashfs_file_t *file;
+
+	file = hashfs_file_new(msg->file->filename, NULL);
+
+	if (!g_strcmp0(file->fingerprint, msg->file->fingerprint))
+		hashfs_file_checkpoint(file, msg->hashes, msg->blocks);
+
+	hashfs_file_destroy(file);
+}
+
+/* Hashes many files at once, grouped by the device they are on and
+   capped per device by hashfs.streams_rotational and
+   hashfs.streams_solid. Files can be added from any thread, before or
+   while it runs */
+hashfs_sched_t *
+hashfs_sched_new (void)
+{
+	hashfs_sched_t *sched;
+	gchar *order;
+
+	sched = g_new0(hashfs_sched_t, 1);
+	sched->copies = TRUE;
+	sched->window = MAX(hashfs_config_property_lookup_int("hashfs", "hash_window"), 1);
+	sched->threads = g_ptr_array_new();
+
+	hashfs_config_property_lookup("hashfs", "hash_order", &order);
+	sched->disk_order = !g_strcmp0(order, "disk");
+	g_free(order);
+
+	g_mutex_init(&sched->lock);
+	g_cond_init(&sched->cond);
+	sched->done = g_async_queue_new();
+
+	return sched;
+}
+
+void
+hashfs_sched_set_copies (hashfs_sched_t *sched, gboolean copies)
+{
+	sched->copies = copies;
+}
+
+/* Queue a file as it was when info was taken, for the digests in
+   types. Files with all of them cached, or taken from a copy, go
+   straight to the thread running the scheduler */
+void
+hashfs_sched_add (hashfs_sched_t *sched, const gchar *filename, struct stat *info,
+                  gint types)
+{
+	hashfs_sched_dev_t *sdev;
+	hashfs_sched_item_t *item;
+	hashfs_sched_msg_t *msg;
+	hashfs_file_t *file;
+	gint missing;
+
+	file = hashfs_file_peek(filename, info);
+
+	/* Files hashed before this was stored get it as well, so copies
+	   made of them later on can be found. Nothing is looked up by it
+	   without copies */
+	if (sched->copies && !file->quick)
+		file->quick = hashfs_file_quick(filename, info);
+
+	missing = hashfs_file_missing(file, types);
+
+	if (missing != 0 && sched->copies && hashfs_file_copy_lookup(file))
+		missing = hashfs_file_missing(file, types);
+
+	if (missing == 0 || file->size < 1) {
+		g_mutex_lock(&sched->lock);
+		sched->queued++;
+		g_mutex_unlock(&sched->lock);
+
+		msg = g_new0(hashfs_sched_msg_t, 1);
+		msg->file = file;
+
+		g_async_queue_push(sched->done, msg);
+
+		return;
+	}
+
+	file->checkpoint_func = hashfs_sched_checkpoint;
+	file->checkpoint_data = sched;
+
+	item = g_new0(hashfs_sched_item_t, 1);
+	item->file = file;
+	item->types = missing;
+
+	g_mutex_lock(&sched->lock);
+	sdev = hashfs_sched_dev_get(sched, info->st_dev);
+	g_mutex_unlock(&sched->lock);
+
+	/* Opens the file, the other threads adding files go on meanwhile */
+	if (sched->disk_order)
+		hashfs_sched_position(sdev, item, info);
+
+	g_mutex_lock(&sched->lock);
+
+	/* One sweep across the disk instead of seeking back and forth
+	   between files */
+	if (sched->disk_order)
+		g_sequence_insert_sorted(sdev->files, item, hashfs_sched_cmp_disk, NULL);
+	else
+		g_sequence_insert_sorted(sdev->files, item, hashfs_sched_cmp, NULL);
+
+	sched->queued++;
+	sched->waiting++;
+
+	hashfs_sched_spawn(sched);
+	g_cond_signal(&sched->cond);
+
+	g_mutex_unlock(&sched->lock);
+}
+
+/* No more files are added, the devices hash what they hold back */
+void
+hashfs_sched_close (hashfs_sched_t *sched)
+{
+	g_mutex_lock(&sched->lock);
+	sched->closed = TRUE;
+	g_cond_broadcast(&sched->cond);
+	g_mutex_unlock(&sched->lock);
+
+	g_async_queue_push(sched->done, &sched_end);
+}
+
+/* Hash the files added and call func for each of them, in the calling
+   thread and in the order they finish. Returns once the scheduler is
+   closed and every file added was handed to func */
+void
+hashfs_sched_run (hashfs_sched_t *sched, hashfs_sched_func func, gpointer data)
+{
+	hashfs_sched_msg_t *msg;
+	gboolean closed = FALSE;
+	gint handled = 0, queued = 0, due;
+
+	g_mutex_lock(&sched->lock);
+	sched->running = TRUE;
+	hashfs_sched_spawn(sched);
+	g_mutex_unlock(&sched->lock);
+
+	while (!closed || handled < queued) {
+		/* Files finish far apart when they are big, the batch they
+		   went into still has to be committed in time */
+		if ((due = hashfs_db_tran_due()) < 0) {
+			msg = g_async_queue_pop(sched->done);
+		} else if (!(msg = g_async_queue_timeout_pop(sched->done, (guint64) due * 1000))) {
+			hashfs_db_tran_flush();
+
+			continue;
+		}
+
+		/* Every file is added by now */
+		if (msg == (gpointer) &sched_end) {
+			g_mutex_lock(&sched->lock);
+			queued = sched->queued;
+			g_mutex_unlock(&sched->lock);
+
+			closed = TRUE;
+
+			continue;
+		}
+
+		if (msg->hashes) {
+			hashfs_sched_store(msg);
+			g_free(msg->hashes);
+		} else {
+			func(msg->file, data);
+			hashfs_file_destroy(msg->file);
+
+			handled++;
+		}
+
+		g_free(msg);
+	}
+
+	for (guint i = 0; i < sched->threads->len; i++)
+		g_thread_join(g_ptr_array_index(sched->threads, i));
+
+	if (sched->threads->len > 0) {
+		HASHFS_LOG("Hashed %d files on %d devices, up to %u at a time",
+		           queued, g_list_length(sched->devs), sched->threads->len);
+
+		hashfs_hash_streams(1);
+	}
+
+	g_ptr_array_set_size(sched->threads, 0);
+	sched->running = FALSE;
+}
+
+void
+hashfs_sched_destroy (hashfs_sched_t *sched)
+{
+	hashfs_sched_dev_t *sdev;
+	hashfs_sched_msg_t *msg;
+	GList *item;
+
+	/* Files never handed out when the scheduler didn't run */
+	while ((msg = g_async_queue_try_pop(sched->done))) {
+		if (msg == (gpointer) &sched_end)
+			continue;
+
+		if (!msg->hashes)
+			hashfs_file_destroy(msg->file);
+
+		g_free(msg->hashes);
+		g_free(msg);
+	}
+
+	for (item = sched->devs; item; item = g_list_next(item)) {
+		sdev = item->data;
+
+		g_sequence_foreach(sdev->files, (GFunc) hashfs_sched_item_free, NULL);
+		g_sequence_free(sdev->files);
+		g_free(sdev);
+	}
+
+	g_list_free(sched->devs);
+	g_ptr_array_free(sched->threads, TRUE);
+
+	g_mutex_clear(&sched->lock);
+	g_cond_clear(&sched->cond);
+	g_async_queue_unref(sched->done);
+
+	g_free(sched);
+}
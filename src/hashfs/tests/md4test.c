@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/md4.h>
+
+#include "hashfs.h"
+
+static const gchar *kernels[] = { "scalar", "sse2", "avx2", "avx512" };
+
+/* Message lengths around the 64 byte block and 56 byte padding
+   boundaries, plus a full ed2k block */
+static const gsize lengths[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 127,
+                                 128, 1000, 4096, 65537,
+                                 HASHFS_ED2K_BLOCKSIZE };
+
+static gint
+check_kernel (const gchar *name)
+{
+	const guchar *data[G_N_ELEMENTS(lengths)];
+	gsize len[G_N_ELEMENTS(lengths)];
+	guchar digests[G_N_ELEMENTS(lengths)][16];
+	guchar *out[G_N_ELEMENTS(lengths)];
+	gint n = G_N_ELEMENTS(lengths);
+	gint failed = 0;
+
+	if (!hashfs_md4_set_kernel(name)) {
+		printf("%-8s not supported by this CPU, skipped\n", name);
+
+		return 0;
+	}
+
+	for (gint i = 0; i < n; i++) {
+		guchar *buf = malloc(lengths[i] + 1);
+
+		for (gsize j = 0; j < lengths[i]; j++)
+			buf[j] = (guchar) rand();
+
+		data[i] = buf;
+		len[i] = lengths[i];
+		out[i] = digests[i];
+	}
+
+	/* Every prefix count, so each lane gets to be the short one */
+	for (gint count = 1; count <= n; count++) {
+		hashfs_md4_multi(data, len, out, count);
+
+		for (gint i = 0; i < count; i++) {
+			guchar expected[16];
+
+			MD4(data[i], len[i], expected);
+
+			if (memcmp(expected, digests[i], 16) != 0) {
+				printf("%-8s mismatch, %d messages, length %zu\n", name, count, len[i]);
+				failed++;
+			}
+		}
+	}
+
+	for (gint i = 0; i < n; i++)
+		free((gpointer) data[i]);
+
+	printf("%-8s %d lanes, %s\n", name, hashfs_md4_lanes(), failed ? "FAILED" : "ok");
+
+	return failed;
+}
+
+int
+main (int argc, char *argv[])
+{
+	gint failed = 0;
+
+	srand(1);
+
+	for (gint i = 0; i < G_N_ELEMENTS(kernels); i++)
+		failed += check_kernel(kernels[i]);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,519 @@
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+/* Seconds between progress reports while files are hashed */
+#define UPDATE_PROGRESS 10
+
+/* Files handed from one stage to the next, the stage putting them in
+   waits while limit of them are queued */
+typedef struct hashfs_update_queue_St {
+	GMutex lock;
+	GCond cond;
+	GQueue items;
+	gint limit;
+
+	/* Deepest it got, and how long the stage before was held up */
+	gint depth;
+	gint64 waited;
+} hashfs_update_queue_t;
+
+/* Files through one stage and the time spent on them */
+typedef struct hashfs_update_stage_St {
+	gint files;
+	gint64 bytes;
+	gint64 busy;
+} hashfs_update_stage_t;
+
+/* A hashed file and the backends that want it */
+typedef struct hashfs_update_job_St {
+	hashfs_file_t *file;
+	GList *backends;
+} hashfs_update_job_t;
+
+/* A file matching the globs of some backend, checked on one of the
+   scan threads */
+typedef struct hashfs_update_found_St {
+	gchar *filename;
+	struct stat info;
+	GList *matched;
+} hashfs_update_found_t;
+
+/* Files are found by the walker, checked against the database on the
+   scan threads, hashed by the scheduler, and looked up by the backends
+   and stored on a thread of their own. Every stage runs at the same
+   time, the scheduler starts on a device's files while the walk is
+   still going */
+struct hashfs_update_St {
+	GList *backends;
+	hashfs_sched_t *sched;
+
+	/* Globs of every backend, matched once per file */
+	hashfs_glob_t *glob;
+
+	/* Paths to walk, and the thread walking them */
+	GList *paths;
+	GThread *walker;
+	GThreadPool *checks;
+
+	/* Leave out files a backend saw exactly like they are now */
+	gboolean incremental;
+	gint unchanged;
+
+	/* Files whose entry was found under the path they had before */
+	gint moved;
+
+	/* Backends each queued file goes to, by filename. It and the
+	   counts above are taken under lock by the scan threads */
+	GHashTable *wanted;
+	GMutex lock;
+
+	hashfs_update_queue_t lookups;
+	GThread *thread;
+
+	/* Lookup and persist are counted under lookups.lock */
+	hashfs_update_stage_t scan;
+	hashfs_update_stage_t hash;
+	hashfs_update_stage_t lookup;
+	hashfs_update_stage_t persist;
+
+	/* When hashing started and progress was last reported */
+	gint64 started;
+	gint64 reported;
+};
+
+static gchar update_end;
+
+
+static void
+hashfs_update_queue_push (hashfs_update_queue_t *queue, gpointer item)
+{
+	gint64 start;
+
+	g_mutex_lock(&queue->lock);
+
+	if (g_queue_get_length(&queue->items) >= queue->limit) {
+		start = g_get_monotonic_time();
+
+		while (g_queue_get_length(&queue->items) >= queue->limit)
+			g_cond_wait(&queue->cond, &queue->lock);
+
+		queue->waited += g_get_monotonic_time() - start;
+	}
+
+	g_queue_push_tail(&queue->items, item);
+	queue->depth = MAX(queue->depth, (gint) g_queue_get_length(&queue->items));
+
+	g_cond_broadcast(&queue->cond);
+	g_mutex_unlock(&queue->lock);
+}
+
+static gpointer
+hashfs_update_queue_pop (hashfs_update_queue_t *queue)
+{
+	gpointer item;
+
+	g_mutex_lock(&queue->lock);
+
+	while (!(item = g_queue_pop_head(&queue->items)))
+		g_cond_wait(&queue->cond, &queue->lock);
+
+	g_cond_broadcast(&queue->cond);
+	g_mutex_unlock(&queue->lock);
+
+	return item;
+}
+
+/* Column with the fingerprint of a file when backend last handled it */
+static gchar *
+hashfs_update_unchanged_key (hashfs_backend_t *backend)
+{
+	return g_strdup_printf("hashfs:stat:%s", backend->desc->shortname);
+}
+
+static gdouble
+hashfs_update_secs (gint64 usecs)
+{
+	return usecs / (gdouble) G_USEC_PER_SEC;
+}
+
+static gdouble
+hashfs_update_rate (gdouble amount, gint64 usecs)
+{
+	return usecs > 0 ? amount / hashfs_update_secs(usecs) : 0;
+}
+
+/* Hand a file to every backend that wants it, each one sees what the
+   ones before it set */
+static void
+hashfs_update_lookup (hashfs_update_job_t *job)
+{
+	hashfs_file_t *file = job->file;
+	hashfs_backend_t *backend;
+	GList *item;
+	gboolean handled;
+	gchar *key;
+
+	for (item = job->backends; item; item = g_list_next(item)) {
+		backend = item->data;
+
+		HASHFS_LOG("Handling file: %s (%s)", hashfs_basename(file->filename),
+		           backend->desc->shortname);
+
+		/* Sets it adds are named after it */
+		file->backend = backend;
+		handled = hashfs_backend_file(backend, file);
+
+		/* What an incremental update compares against next time. A
+		   file the backend couldn't handle, or got without a digest
+		   it needs, is tried again */
+		if (!handled || hashfs_file_missing(file, backend->hash_types) != 0) {
+			HASHFS_DEBUG("Backend (%s) to retry file (%s)", backend->desc->shortname, file->filename);
+		} else if (file->fingerprint) {
+			key = hashfs_update_unchanged_key(backend);
+			hashfs_file_prop_set(file, key, file->fingerprint);
+			g_free(key);
+		}
+	}
+}
+
+/* Looks up and stores files in the order they were hashed, a file
+   only goes to the backends once the sets of the one before it are in
+   the database */
+static gpointer
+hashfs_update_thread (gpointer data)
+{
+	hashfs_update_t *update = data;
+	hashfs_update_job_t *job;
+	gint64 start, looked, stored;
+
+	while ((job = hashfs_update_queue_pop(&update->lookups)) != (gpointer) &update_end) {
+		start = g_get_monotonic_time();
+		hashfs_update_lookup(job);
+		looked = g_get_monotonic_time();
+
+		hashfs_file_destroy(job->file);
+		stored = g_get_monotonic_time();
+
+		g_list_free(job->backends);
+		g_free(job);
+
+		g_mutex_lock(&update->lookups.lock);
+
+		update->lookup.files++;
+		update->lookup.busy += looked - start;
+		update->persist.files++;
+		update->persist.busy += stored - looked;
+
+		g_mutex_unlock(&update->lookups.lock);
+	}
+
+	return NULL;
+}
+
+static void
+hashfs_update_progress (hashfs_update_t *update, gint64 elapsed)
+{
+	gint queued, looked;
+
+	g_mutex_lock(&update->lookups.lock);
+
+	queued = g_queue_get_length(&update->lookups.items);
+	looked = update->lookup.files;
+
+	g_mutex_unlock(&update->lookups.lock);
+
+	HASHFS_LOG("Hashed %d files (%.1f MiB/s), %d waiting for lookup, %d looked up",
+	           update->hash.files, hashfs_update_rate(update->hash.bytes / 1048576.0, elapsed),
+	           queued, looked);
+}
+
+/* Called by the scheduler for every file it has hashed */
+static void
+hashfs_update_hashed (hashfs_file_t *hashed, gpointer data)
+{
+	hashfs_update_t *update = data;
+	hashfs_update_job_t *job;
+	gboolean moved;
+	gint64 now;
+
+	/* Moved from another filesystem, the entry at the old path
+	   goes with it when it is adopted */
+	moved = hashfs_file_moved_lookup(hashed);
+
+	job = g_new0(hashfs_update_job_t, 1);
+	job->file = hashfs_file_new(hashed->filename, NULL);
+	hashfs_file_adopt(job->file, hashed);
+
+	g_mutex_lock(&update->lock);
+
+	if (moved)
+		update->moved++;
+
+	job->backends = g_hash_table_lookup(update->wanted, hashed->filename);
+
+	/* The walk may still come across it through another path given */
+	g_hash_table_insert(update->wanted, g_strdup(hashed->filename), NULL);
+	g_mutex_unlock(&update->lock);
+
+	update->hash.files++;
+	update->hash.bytes += hashed->size;
+
+	hashfs_update_queue_push(&update->lookups, job);
+
+	now = g_get_monotonic_time();
+
+	if (now - update->reported >= UPDATE_PROGRESS * G_USEC_PER_SEC) {
+		hashfs_update_progress(update, now - update->started);
+		update->reported = now;
+	}
+}
+
+/* Whether backend has handled the file exactly like it is now */
+static gboolean
+hashfs_update_unchanged (hashfs_backend_t *backend, const gchar *filename,
+                         struct stat *info)
+{
+	gboolean rval;
+	gchar *key;
+
+	key = hashfs_update_unchanged_key(backend);
+	rval = hashfs_file_unchanged(filename, info, key);
+	g_free(key);
+
+	return rval;
+}
+
+static void
+hashfs_update_found_free (hashfs_update_found_t *found)
+{
+	g_free(found->filename);
+	g_list_free(found->matched);
+	g_free(found);
+}
+
+/* Queue a file for the backends it matched, it is hashed once for all
+   of them. Runs on the scan threads, the database lookups and the
+   scheduler opening the file keep the walk from waiting on them */
+static void
+hashfs_update_check (gpointer data, gpointer user_data)
+{
+	hashfs_update_found_t *found = data;
+	hashfs_update_t *update = user_data;
+	hashfs_backend_t *backend;
+	GList *item, *wanted = NULL;
+	gboolean moved;
+	gint types = 0;
+
+	/* Found twice through paths given more than once. It stays in
+	   wanted without backends when none of them needs it */
+	g_mutex_lock(&update->lock);
+
+	if (g_hash_table_contains(update->wanted, found->filename)) {
+		g_mutex_unlock(&update->lock);
+		hashfs_update_found_free(found);
+
+		return;
+	}
+
+	g_hash_table_insert(update->wanted, g_strdup(found->filename), NULL);
+	g_mutex_unlock(&update->lock);
+
+	/* Renamed or moved since, the entry follows it and with it
+	   everything backends know about the file */
+	moved = hashfs_file_find_moved(found->filename, &found->info);
+
+	for (item = found->matched; item; item = g_list_next(item)) {
+		backend = item->data;
+
+		if (update->incremental && hashfs_update_unchanged(backend, found->filename, &found->info))
+			continue;
+
+		/* Only the digests these backends need are hashed */
+		wanted = g_list_append(wanted, backend);
+		types |= backend->hash_types;
+	}
+
+	g_mutex_lock(&update->lock);
+
+	if (moved)
+		update->moved++;
+
+	if (wanted) {
+		g_hash_table_insert(update->wanted, g_strdup(found->filename), wanted);
+		update->scan.files++;
+	} else {
+		update->unchanged++;
+	}
+
+	g_mutex_unlock(&update->lock);
+
+	if (wanted)
+		hashfs_sched_add(update->sched, found->filename, &found->info, types);
+
+	hashfs_update_found_free(found);
+}
+
+/* Called by the walker, only the globs are matched on its thread */
+static void
+hashfs_update_found (const gchar *filename, struct stat *info, gpointer data)
+{
+	hashfs_update_t *update = data;
+	hashfs_update_found_t *found;
+	GList *matched;
+
+	if (!(matched = hashfs_glob_match(update->glob, filename)))
+		return;
+
+	found = g_new0(hashfs_update_found_t, 1);
+	found->filename = g_strdup(filename);
+	found->info = *info;
+	found->matched = matched;
+
+	g_thread_pool_push(update->checks, found, NULL);
+}
+
+/* Walks every path given, on hashfs.walk_threads threads for the
+   directories and as many for the files found. The scheduler is
+   closed once the last file is queued */
+static gpointer
+hashfs_update_walk (gpointer data)
+{
+	hashfs_update_t *update = data;
+	gint64 start;
+	gint threads;
+
+	start = g_get_monotonic_time();
+
+	threads = MAX(hashfs_config_property_lookup_int("hashfs", "walk_threads"), 1);
+	update->checks = g_thread_pool_new(hashfs_update_check, update, threads, TRUE, NULL);
+
+	for (GList *item = update->paths; item; item = g_list_next(item))
+		hashfs_walk(item->data, hashfs_update_found, update);
+
+	g_thread_pool_free(update->checks, FALSE, TRUE);
+	update->checks = NULL;
+
+	update->scan.busy = g_get_monotonic_time() - start;
+
+	hashfs_sched_close(update->sched);
+
+	return NULL;
+}
+
+/* Runs backends on files matching their globs. A file is hashed once
+   for the digests the backends that want it need, and with
+   incremental set a backend is left out for files it saw exactly like
+   they are now */
+hashfs_update_t *
+hashfs_update_new (GList *backends, gboolean incremental)
+{
+	hashfs_update_t *update;
+	hashfs_backend_t *backend;
+	GList *item;
+
+	update = g_new0(hashfs_update_t, 1);
+	update->glob = hashfs_glob_new();
+
+	for (item = backends; item; item = g_list_next(item)) {
+		backend = item->data;
+
+		hashfs_backend_glob_add(backend, update->glob);
+	}
+
+	update->backends = g_list_copy(backends);
+	update->sched = hashfs_sched_new();
+	update->incremental = incremental;
+	update->wanted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	g_mutex_init(&update->lock);
+
+	g_mutex_init(&update->lookups.lock);
+	g_cond_init(&update->lookups.cond);
+	g_queue_init(&update->lookups.items);
+
+	update->lookups.limit = MAX(hashfs_config_property_lookup_int("hashfs", "lookup_queue"), 1);
+
+	return update;
+}
+
+/* Walked by hashfs_update_run */
+void
+hashfs_update_scan (hashfs_update_t *update, const gchar *path)
+{
+	update->paths = g_list_append(update->paths, g_strdup(path));
+}
+
+void
+hashfs_update_run (hashfs_update_t *update)
+{
+	gint depth;
+
+	update->thread = g_thread_new("hashfs-lookup", hashfs_update_thread, update);
+
+	update->started = g_get_monotonic_time();
+	update->reported = update->started;
+
+	update->walker = g_thread_new("hashfs-scan", hashfs_update_walk, update);
+
+	hashfs_sched_run(update->sched, hashfs_update_hashed, update);
+
+	update->hash.busy = g_get_monotonic_time() - update->started;
+
+	/* Closed the scheduler on its way out */
+	g_thread_join(update->walker);
+
+	if (update->moved > 0)
+		HASHFS_LOG("Found %d renamed or moved files", update->moved);
+
+	if (update->unchanged > 0)
+		HASHFS_LOG("Skipped %d unchanged files", update->unchanged);
+
+	/* Before the end marker adds to it */
+	depth = update->lookups.depth;
+
+	hashfs_update_queue_push(&update->lookups, &update_end);
+	g_thread_join(update->thread);
+
+	hashfs_db_tran_flush();
+
+	HASHFS_LOG("scan: %d files in %.1fs",
+	           update->scan.files, hashfs_update_secs(update->scan.busy));
+	HASHFS_LOG("hash: %d files, %.1f MiB/s, held up %.1fs by a full lookup queue",
+	           update->hash.files, hashfs_update_rate(update->hash.bytes / 1048576.0, update->hash.busy),
+	           hashfs_update_secs(update->lookups.waited));
+	HASHFS_LOG("lookup: %d files, %.2f files/s, up to %d of %d queued",
+	           update->lookup.files, hashfs_update_rate(update->lookup.files, update->lookup.busy),
+	           depth, update->lookups.limit);
+	HASHFS_LOG("persist: %d files, %.1f files/s",
+	           update->persist.files, hashfs_update_rate(update->persist.files, update->persist.busy));
+}
+
+void
+hashfs_update_destroy (hashfs_update_t *update)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	hashfs_sched_destroy(update->sched);
+
+	/* Files no backend needed, and any left over */
+	g_hash_table_iter_init(&iter, update->wanted);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		g_list_free(value);
+
+	g_hash_table_destroy(update->wanted);
+	g_mutex_clear(&update->lock);
+
+	g_list_free_full(update->paths, g_free);
+	g_list_free(update->backends);
+	hashfs_glob_destroy(update->glob);
+
+	g_mutex_clear(&update->lookups.lock);
+	g_cond_clear(&update->lookups.cond);
+
+	g_free(update);
+}
@@ -5,10 +5,11 @@
 
 #include "hashfs.h"
 
+/* The part after the last /, all of name without one */
 gchar *
 hashfs_basename (const gchar *name)
 {
-	gchar *ptr, *base;
+	gchar *ptr, *base = (gchar *) name;
 
 	for (ptr = (gchar *) name; *ptr; ptr++) {
 		if (*ptr == '/') {
@@ -33,9 +34,108 @@ hashfs_current_time (void)
 	return g_strdup(buf);
 }
 
+/* Absolute path without . and .. in it, the way files are stored.
+   Symlinks are left alone, the path may not be there (yet) */
+gchar *
+hashfs_canonical_path (const gchar *path)
+{
+#if GLIB_CHECK_VERSION(2, 58, 0)
+	return g_canonicalize_filename(path, NULL);
+#else
+	gchar **parts, *absolute, *cwd, *joined, *canonical;
+	GPtrArray *kept;
+
+	if (g_path_is_absolute(path)) {
+		absolute = g_strdup(path);
+	} else {
+		cwd = g_get_current_dir();
+		absolute = g_build_filename(cwd, path, NULL);
+		g_free(cwd);
+	}
+
+	parts = g_strsplit(absolute, G_DIR_SEPARATOR_S, -1);
+	kept = g_ptr_array_new();
+
+	for (gchar **part = parts; *part; part++) {
+		if (!**part || !strcmp(*part, "."))
+			continue;
+
+		if (!strcmp(*part, "..")) {
+			if (kept->len > 0)
+				g_ptr_array_remove_index(kept, kept->len - 1);
+
+			continue;
+		}
+
+		g_ptr_array_add(kept, *part);
+	}
+
+	g_ptr_array_add(kept, NULL);
+
+	joined = g_strjoinv(G_DIR_SEPARATOR_S, (gchar **) kept->pdata);
+	canonical = g_strconcat(G_DIR_SEPARATOR_S, joined, NULL);
+
+	g_free(joined);
+	g_ptr_array_free(kept, TRUE);
+	g_strfreev(parts);
+	g_free(absolute);
+
+	return canonical;
+#endif
+}
+
 gchar *
 hashfs_md5_str (const gchar *str)
 {
 	return g_compute_checksum_for_string(G_CHECKSUM_MD5, str, -1);
 }
 
+
+gchar *
+hashfs_hex_str (const guchar *data, gsize len)
+{
+	static const gchar hexdigits[16] = "0123456789abcdef";
+	gchar *str;
+
+	str = g_strnfill((len * 2) + 1, 0);
+
+	for (gsize i = 0; i < len; i++) {
+		str[(i<<1)] = hexdigits[(((data[i]) & 0xf0) >> 4)];
+		str[(i<<1)+1] = hexdigits[(((data[i]) & 0x0f))];
+	}
+
+	return str;
+}
+
+/* Inverse of hashfs_hex_str, NULL if str isn't valid hex */
+guchar *
+hashfs_hex_bin (const gchar *str, gsize *len)
+{
+	guchar *data;
+	gsize n;
+	gint hi, lo;
+
+	n = strlen(str);
+
+	if (n % 2 != 0)
+		return NULL;
+
+	data = g_malloc(MAX(n / 2, 1));
+
+	for (gsize i = 0; i < n / 2; i++) {
+		hi = g_ascii_xdigit_value(str[(i<<1)]);
+		lo = g_ascii_xdigit_value(str[(i<<1)+1]);
+
+		if (hi < 0 || lo < 0) {
+			g_free(data);
+
+			return NULL;
+		}
+
+		data[i] = (hi << 4) | lo;
+	}
+
+	*len = n / 2;
+
+	return data;
+}
@@ -0,0 +1,161 @@
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "hashfs.h"
+
+static gint
+hashfs_verify_cmp (gconstpointer a, gconstpointer b)
+{
+	return *(const gint *) a - *(const gint *) b;
+}
+
+/* The stored block digests of a file hashed while it looked like it
+   does now, NULL if there are none */
+static guchar *
+hashfs_verify_hashes (const gchar *filename, struct stat *info,
+                      hashfs_verify_status_t *status)
+{
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+	gchar *fingerprint;
+	guchar *hashes = NULL;
+	gsize len;
+	gint blocks;
+
+	blocks = hashfs_ed2k_blocks(info->st_size);
+	fingerprint = hashfs_file_fingerprint(info);
+	entry = hashfs_db_entry_new("file", filename, NULL, NULL);
+
+	*status = HASHFS_VERIFY_UNKNOWN;
+
+	if (!hashfs_db_entry_lookup(entry, "hashfs:stat", &val)) {
+		/* Never hashed */
+	} else if (g_strcmp0(val, fingerprint) != 0) {
+		*status = HASHFS_VERIFY_CHANGED;
+	} else if (blocks > 1) {
+		if (hashfs_db_entry_lookup(entry, "hashfs:ed2k_blocks", &val) && *val)
+			hashes = g_base64_decode(val, &len);
+	} else {
+		if (hashfs_db_entry_lookup(entry, "hashfs:ed2k", &val) && *val)
+			hashes = hashfs_hex_bin(val, &len);
+	}
+
+	/* Anything short of the full list is an unfinished checkpoint */
+	if (hashes && len != blocks * 16) {
+		g_free(hashes);
+		hashes = NULL;
+	}
+
+	hashfs_db_entry_destroy(entry);
+	g_free(fingerprint);
+
+	return hashes;
+}
+
+/* Pick samples distinct blocks, always including the last one since
+   that's the one a truncated copy gets wrong */
+static GArray *
+hashfs_verify_sample (gint blocks, gint samples)
+{
+	GArray *indices;
+	gboolean *picked;
+	gint index;
+
+	indices = g_array_new(FALSE, FALSE, sizeof(gint));
+
+	if (samples <= 0 || samples >= blocks) {
+		for (gint i = 0; i < blocks; i++)
+			g_array_append_val(indices, i);
+
+		return indices;
+	}
+
+	picked = g_new0(gboolean, blocks);
+
+	index = blocks - 1;
+	picked[index] = TRUE;
+	g_array_append_val(indices, index);
+
+	while (indices->len < samples) {
+		index = g_random_int_range(0, blocks);
+
+		if (!picked[index]) {
+			picked[index] = TRUE;
+			g_array_append_val(indices, index);
+		}
+	}
+
+	g_free(picked);
+
+	g_array_sort(indices, hashfs_verify_cmp);
+
+	return indices;
+}
+
+/* Re-read the given blocks, or samples random ones when blocks is
+   NULL (0 checks them all), and compare them with the MD4 digests
+   stored when the file was hashed. Indices of blocks that don't
+   match are appended to bad */
+hashfs_verify_status_t
+hashfs_verify_file (const gchar *filename, GArray *blocks, gint samples,
+                    GArray *bad)
+{
+	hashfs_verify_status_t status;
+	hashfs_reader_t *reader;
+	hashfs_block_t *block;
+	struct stat info;
+	GArray *indices;
+	guchar *hashes, md[16];
+	gint total, index;
+
+	if (g_stat(filename, &info) != 0 || info.st_size < 1)
+		return HASHFS_VERIFY_FAILED;
+
+	if (!(hashes = hashfs_verify_hashes(filename, &info, &status)))
+		return status;
+
+	if (!(reader = hashfs_reader_new(filename, info.st_size))) {
+		g_free(hashes);
+
+		return HASHFS_VERIFY_FAILED;
+	}
+
+	total = hashfs_ed2k_blocks(info.st_size);
+
+	if (blocks)
+		indices = g_array_ref(blocks);
+	else
+		indices = hashfs_verify_sample(total, samples);
+
+	status = HASHFS_VERIFY_OK;
+
+	for (guint i = 0; i < indices->len && status != HASHFS_VERIFY_FAILED; i++) {
+		index = g_array_index(indices, gint, i);
+
+		if (index < 0 || index >= total)
+			continue;
+
+		if (!(block = hashfs_reader_read(reader, index))) {
+			status = HASHFS_VERIFY_FAILED;
+
+			break;
+		}
+
+		hashfs_md4(block->data, block->len, md);
+		hashfs_block_unref(block);
+
+		if (memcmp(md, hashes + (index * 16), 16) != 0) {
+			g_array_append_val(bad, index);
+
+			status = HASHFS_VERIFY_CORRUPT;
+		}
+	}
+
+	g_array_unref(indices);
+	hashfs_reader_destroy(reader);
+	g_free(hashes);
+
+	return status;
+}
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "hashfs.h"
+
+/* Room for a few hundred entries per getdents64 call, NFS answers
+   each one with a single READDIRPLUS */
+#define WALK_BUFSIZE (64 * 1024)
+
+struct hashfs_walk_dirent {
+	guint64 d_ino;
+	gint64 d_off;
+	gushort d_reclen;
+	guchar d_type;
+	gchar d_name[];
+};
+
+/* A directory waiting to be read. Its parent stays open until all
+   of its subdirectories are, so they can be opened relative to it
+   without resolving the whole path again */
+typedef struct hashfs_walk_dir_St {
+	struct hashfs_walk_dir_St *parent;
+	gchar *path;
+	dev_t dev;
+	ino_t ino;
+	gint fd;
+
+	/* Held by the directory and every subdirectory, and by the
+	   directory and every subdirectory not opened yet */
+	gint refs;
+	gint opens;
+} hashfs_walk_dir_t;
+
+/* Directories found by one thread, taken from the tail by it and from
+   the head by the others once they run out */
+typedef struct hashfs_walk_deque_St {
+	GMutex lock;
+	GQueue dirs;
+} hashfs_walk_deque_t;
+
+/* A regular file found, stat'ed by the thread that read its directory */
+typedef struct hashfs_walk_file_St {
+	gchar *filename;
+	struct stat info;
+} hashfs_walk_file_t;
+
+typedef struct hashfs_walk_St {
+	hashfs_walk_deque_t *deques;
+	gint threads;
+
+	/* Directories queued or being read, the walk is over at 0 */
+	gint pending;
+	GMutex lock;
+	GCond cond;
+
+	/* Regular files found, and one end marker per thread */
+	GAsyncQueue *found;
+} hashfs_walk_t;
+
+typedef struct hashfs_walk_thread_St {
+	hashfs_walk_t *walk;
+	gint index;
+} hashfs_walk_thread_t;
+
+static gchar walk_end;
+
+
+static void
+hashfs_walk_dir_unref (hashfs_walk_dir_t *dir)
+{
+	if (!g_atomic_int_dec_and_test(&dir->refs))
+		return;
+
+	if (dir->parent)
+		hashfs_walk_dir_unref(dir->parent);
+
+	g_free(dir->path);
+	g_free(dir);
+}
+
+/* Close the directory once nothing needs to be opened relative to it */
+static void
+hashfs_walk_dir_close (hashfs_walk_dir_t *dir)
+{
+	if (g_atomic_int_dec_and_test(&dir->opens) && dir->fd >= 0) {
+		close(dir->fd);
+		dir->fd = -1;
+	}
+}
+
+static void
+hashfs_walk_push (hashfs_walk_t *walk, gint index, hashfs_walk_dir_t *dir)
+{
+	hashfs_walk_deque_t *deque = &walk->deques[index];
+
+	g_atomic_int_inc(&walk->pending);
+
+	g_mutex_lock(&deque->lock);
+	g_queue_push_tail(&deque->dirs, dir);
+	g_mutex_unlock(&deque->lock);
+
+	g_mutex_lock(&walk->lock);
+	g_cond_signal(&walk->cond);
+	g_mutex_unlock(&walk->lock);
+}
+
+/* The newest directory of this thread, or the oldest of another one */
+static hashfs_walk_dir_t *
+hashfs_walk_pop (hashfs_walk_t *walk, gint index)
+{
+	hashfs_walk_deque_t *deque;
+	hashfs_walk_dir_t *dir;
+
+	deque = &walk->deques[index];
+
+	g_mutex_lock(&deque->lock);
+	dir = g_queue_pop_tail(&deque->dirs);
+	g_mutex_unlock(&deque->lock);
+
+	for (gint i = 1; !dir && i < walk->threads; i++) {
+		deque = &walk->deques[(index + i) % walk->threads];
+
+		g_mutex_lock(&deque->lock);
+		dir = g_queue_pop_head(&deque->dirs);
+		g_mutex_unlock(&deque->lock);
+	}
+
+	return dir;
+}
+
+/* Open a directory and tell it apart from the ones above it, a link
+   back to any of them would make the walk go in circles */
+static gboolean
+hashfs_walk_dir_open (hashfs_walk_dir_t *dir)
+{
+	hashfs_walk_dir_t *parent = dir->parent;
+	struct stat info;
+
+	if (parent) {
+		dir->fd = openat(parent->fd, dir->path + strlen(parent->path) + 1,
+		                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		hashfs_walk_dir_close(parent);
+	}
+
+	if (dir->fd < 0 || fstat(dir->fd, &info) != 0) {
+		HASHFS_DEBUG("Failed to open directory (%s): %s", dir->path, g_strerror(errno));
+
+		return FALSE;
+	}
+
+	dir->dev = info.st_dev;
+	dir->ino = info.st_ino;
+
+	for (; parent; parent = parent->parent) {
+		if (parent->dev == dir->dev && parent->ino == dir->ino) {
+			HASHFS_DEBUG("Directory (%s) links back to %s", dir->path, parent->path);
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Hand every regular file in dir to the calling thread along with its
+   stat, and queue its subdirectories. d_type saves a stat of every
+   directory but links and filesystems that leave it out */
+static void
+hashfs_walk_read (hashfs_walk_t *walk, gint index, hashfs_walk_dir_t *dir, gchar *buf)
+{
+	struct hashfs_walk_dirent *ent;
+	hashfs_walk_dir_t *sub;
+	hashfs_walk_file_t *file;
+	struct stat info;
+	glong len, pos;
+	guchar type;
+	gboolean stated;
+
+	while ((len = syscall(SYS_getdents64, dir->fd, buf, WALK_BUFSIZE)) > 0) {
+		for (pos = 0; pos < len; pos += ent->d_reclen) {
+			ent = (struct hashfs_walk_dirent *) (buf + pos);
+
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+
+			type = ent->d_type;
+			stated = FALSE;
+
+			if (type == DT_LNK || type == DT_UNKNOWN) {
+				if (fstatat(dir->fd, ent->d_name, &info, 0) != 0)
+					continue;
+
+				type = S_ISREG(info.st_mode) ? DT_REG : S_ISDIR(info.st_mode) ? DT_DIR : DT_UNKNOWN;
+				stated = TRUE;
+			}
+
+			if (type == DT_REG) {
+				/* Gone since it was listed */
+				if (!stated && fstatat(dir->fd, ent->d_name, &info, 0) != 0)
+					continue;
+
+				file = g_new(hashfs_walk_file_t, 1);
+				file->filename = g_strconcat(dir->path, G_DIR_SEPARATOR_S, ent->d_name, NULL);
+				file->info = info;
+
+				g_async_queue_push(walk->found, file);
+			} else if (type == DT_DIR) {
+				g_atomic_int_inc(&dir->refs);
+				g_atomic_int_inc(&dir->opens);
+
+				sub = g_new0(hashfs_walk_dir_t, 1);
+				sub->parent = dir;
+				sub->path = g_strconcat(dir->path, G_DIR_SEPARATOR_S, ent->d_name, NULL);
+				sub->fd = -1;
+				sub->refs = 1;
+				sub->opens = 1;
+
+				hashfs_walk_push(walk, index, sub);
+			}
+		}
+	}
+
+	if (len < 0)
+		HASHFS_DEBUG("Failed to read directory (%s): %s", dir->path, g_strerror(errno));
+}
+
+static gpointer
+hashfs_walk_thread (gpointer data)
+{
+	hashfs_walk_thread_t *thread = data;
+	hashfs_walk_t *walk = thread->walk;
+	hashfs_walk_dir_t *dir;
+	gchar *buf;
+
+	buf = g_malloc(WALK_BUFSIZE);
+
+	for (;;) {
+		if (!(dir = hashfs_walk_pop(walk, thread->index))) {
+			g_mutex_lock(&walk->lock);
+
+			while (!(dir = hashfs_walk_pop(walk, thread->index)) && g_atomic_int_get(&walk->pending) > 0)
+				g_cond_wait(&walk->cond, &walk->lock);
+
+			g_mutex_unlock(&walk->lock);
+
+			if (!dir)
+				break;
+		}
+
+		if (hashfs_walk_dir_open(dir))
+			hashfs_walk_read(walk, thread->index, dir, buf);
+
+		hashfs_walk_dir_close(dir);
+		hashfs_walk_dir_unref(dir);
+
+		if (g_atomic_int_dec_and_test(&walk->pending)) {
+			g_mutex_lock(&walk->lock);
+			g_cond_broadcast(&walk->cond);
+			g_mutex_unlock(&walk->lock);
+		}
+	}
+
+	g_free(buf);
+
+	g_async_queue_push(walk->found, &walk_end);
+
+	return NULL;
+}
+
+/* Call func for every regular file under path, or for path itself if
+   it is one. Directories are read and their files stat'ed by
+   hashfs.walk_threads threads, func is called in the calling thread
+   in no particular order */
+void
+hashfs_walk (const gchar *path, hashfs_walk_func func, gpointer data)
+{
+	hashfs_walk_t walk = { 0 };
+	hashfs_walk_thread_t *threads;
+	hashfs_walk_dir_t *root;
+	hashfs_walk_file_t *file;
+	struct stat info;
+	GThread **handles;
+	gint ended = 0;
+
+	if (g_stat(path, &info) != 0)
+		return;
+
+	if (!S_ISDIR(info.st_mode)) {
+		if (S_ISREG(info.st_mode))
+			func(path, &info, data);
+
+		return;
+	}
+
+	HASHFS_LOG("Searching directory: %s", path);
+
+	root = g_new0(hashfs_walk_dir_t, 1);
+	root->path = g_strdup(path);
+	root->fd = g_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	root->refs = 1;
+	root->opens = 1;
+
+	/* Paths are built as parent/name, "/" becomes "" for that */
+	while (g_str_has_suffix(root->path, G_DIR_SEPARATOR_S))
+		root->path[strlen(root->path) - 1] = '\0';
+
+	walk.threads = MAX(hashfs_config_property_lookup_int("hashfs", "walk_threads"), 1);
+	walk.deques = g_new0(hashfs_walk_deque_t, walk.threads);
+	walk.found = g_async_queue_new();
+
+	g_mutex_init(&walk.lock);
+	g_cond_init(&walk.cond);
+
+	for (gint i = 0; i < walk.threads; i++) {
+		g_mutex_init(&walk.deques[i].lock);
+		g_queue_init(&walk.deques[i].dirs);
+	}
+
+	hashfs_walk_push(&walk, 0, root);
+
+	threads = g_new0(hashfs_walk_thread_t, walk.threads);
+	handles = g_new0(GThread *, walk.threads);
+
+	for (gint i = 0; i < walk.threads; i++) {
+		threads[i].walk = &walk;
+		threads[i].index = i;
+
+		handles[i] = g_thread_new("hashfs-walk", hashfs_walk_thread, &threads[i]);
+	}
+
+	while (ended < walk.threads) {
+		file = g_async_queue_pop(walk.found);
+
+		if (file == (gpointer) &walk_end) {
+			ended++;
+
+			continue;
+		}
+
+		func(file->filename, &file->info, data);
+
+		g_free(file->filename);
+		g_free(file);
+	}
+
+	for (gint i = 0; i < walk.threads; i++) {
+		g_thread_join(handles[i]);
+		g_mutex_clear(&walk.deques[i].lock);
+	}
+
+	g_free(handles);
+	g_free(threads);
+	g_free(walk.deques);
+
+	g_async_queue_unref(walk.found);
+
+	g_mutex_clear(&walk.lock);
+	g_cond_clear(&walk.cond);
+}
@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "hashfs.h"
+
+/* Holds a few hundred events, more are read on the next round */
+#define WATCH_BUFSIZE (64 * 1024)
+
+/* Files are picked up once closed after writing or moved in, and
+   directories followed as they come and go */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+struct hashfs_watch_St {
+	GList *backends;
+	gint fd;
+
+	/* Directories given, read again when the kernel drops events */
+	GList *roots;
+
+	/* Path of every directory watched, by watch descriptor */
+	GHashTable *dirs;
+
+	/* Files waiting to settle, by path. Each event for one puts it
+	   off by hashfs.watch_settle_ms */
+	GHashTable *pending;
+	gint64 settle;
+
+	/* Files and directories moved away by cookie, until the other
+	   half of the rename shows up or the events run out */
+	GHashTable *moves;
+	GHashTable *dir_moves;
+
+	/* Batches of settled files, updated one after the other on a
+	   thread of their own so events keep being read meanwhile */
+	GAsyncQueue *settled;
+	GThread *thread;
+};
+
+static volatile sig_atomic_t watch_stop;
+
+static gchar watch_end;
+
+
+static void
+hashfs_watch_signal (gint signum)
+{
+	watch_stop = 1;
+}
+
+/* Queue a file, or put it off if it is queued already */
+static void
+hashfs_watch_touch (hashfs_watch_t *watch, const gchar *path)
+{
+	gint64 *due;
+
+	due = g_new(gint64, 1);
+	*due = g_get_monotonic_time() + watch->settle;
+
+	g_hash_table_replace(watch->pending, g_strdup(path), due);
+}
+
+static gboolean
+hashfs_watch_under (const gchar *path, const gchar *dir)
+{
+	gsize len = strlen(dir);
+
+	return !strncmp(path, dir, len) && (path[len] == '\0' || path[len] == G_DIR_SEPARATOR);
+}
+
+/* Watch dir and everything below it. Files already there are queued
+   when found is set, they may have come in before the watch did */
+static gboolean
+hashfs_watch_dir_add (hashfs_watch_t *watch, const gchar *path, gboolean found)
+{
+	const gchar *name;
+	gchar *fullpath;
+	struct stat info;
+	GDir *dir;
+	gint *wd;
+
+	wd = g_new(gint, 1);
+
+	/* The same directory under a new name keeps its descriptor */
+	if ((*wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS)) < 0) {
+		HASHFS_DEBUG("Failed to watch directory (%s): %s", path, g_strerror(errno));
+		g_free(wd);
+
+		return FALSE;
+	}
+
+	g_hash_table_replace(watch->dirs, wd, g_strdup(path));
+
+	if (!(dir = g_dir_open(path, 0, NULL)))
+		return TRUE;
+
+	while ((name = g_dir_read_name(dir))) {
+		fullpath = g_build_filename(path, name, NULL);
+
+		if (g_lstat(fullpath, &info) == 0) {
+			if (S_ISDIR(info.st_mode))
+				hashfs_watch_dir_add(watch, fullpath, found);
+			else if (S_ISREG(info.st_mode) && found)
+				hashfs_watch_touch(watch, fullpath);
+		}
+
+		g_free(fullpath);
+	}
+
+	g_dir_close(dir);
+
+	return TRUE;
+}
+
+/* Stop watching a directory moved away and everything below it, the
+   watches come back if it shows up under another watched one. The
+   entries of its files stay until it turns out it didn't */
+static void
+hashfs_watch_dir_remove (hashfs_watch_t *watch, const gchar *path)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, watch->dirs);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (hashfs_watch_under(value, path)) {
+			inotify_rm_watch(watch->fd, *(gint *) key);
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	g_hash_table_iter_init(&iter, watch->pending);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (hashfs_watch_under(key, path))
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
+static void
+hashfs_watch_event (hashfs_watch_t *watch, struct inotify_event *event)
+{
+	const gchar *dir, *from;
+	gchar *path;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		HASHFS_LOG("Missed events, checking every watched directory");
+
+		for (GList *item = watch->roots; item; item = g_list_next(item))
+			hashfs_watch_dir_add(watch, item->data, TRUE);
+
+		return;
+	}
+
+	if (event->mask & IN_IGNORED) {
+		g_hash_table_remove(watch->dirs, &event->wd);
+
+		return;
+	}
+
+	if (!(dir = g_hash_table_lookup(watch->dirs, &event->wd)) || event->len == 0)
+		return;
+
+	path = g_build_filename(dir, event->name, NULL);
+
+	if (event->mask & IN_ISDIR) {
+		/* Renamed within the watched directories, its files find
+		   their entries again by inode once settled */
+		if (event->mask & IN_MOVED_TO)
+			g_hash_table_remove(watch->dir_moves, GUINT_TO_POINTER(event->cookie));
+
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			hashfs_watch_dir_add(watch, path, TRUE);
+		} else if (event->mask & IN_MOVED_FROM) {
+			hashfs_watch_dir_remove(watch, path);
+			g_hash_table_replace(watch->dir_moves, GUINT_TO_POINTER(event->cookie), g_strdup(path));
+		}
+	} else if (event->mask & IN_MOVED_FROM) {
+		g_hash_table_replace(watch->moves, GUINT_TO_POINTER(event->cookie), g_strdup(path));
+	} else if (event->mask & IN_MOVED_TO) {
+		/* Renamed within the watched directories, it keeps its entry
+		   and is left out once settled unless it changed meanwhile */
+		if ((from = g_hash_table_lookup(watch->moves, GUINT_TO_POINTER(event->cookie)))) {
+			hashfs_file_move(from, path);
+
+			g_hash_table_remove(watch->pending, from);
+			g_hash_table_remove(watch->moves, GUINT_TO_POINTER(event->cookie));
+		}
+
+		hashfs_watch_touch(watch, path);
+	} else if (event->mask & IN_CLOSE_WRITE) {
+		hashfs_watch_touch(watch, path);
+	} else if (event->mask & IN_MODIFY) {
+		/* Still being written */
+		if (g_hash_table_lookup(watch->pending, path))
+			hashfs_watch_touch(watch, path);
+	} else if (event->mask & IN_DELETE) {
+		g_hash_table_remove(watch->pending, path);
+		hashfs_file_remove(path);
+	}
+
+	g_free(path);
+}
+
+/* Drop the entries of every file below a directory moved away. The
+   query can't hold every path as is, what it returns is checked again */
+static void
+hashfs_watch_dir_forget (const gchar *path)
+{
+	hashfs_db_query_t *query;
+	hashfs_db_result_t *result;
+	hashfs_db_entry_t *entry;
+	const gchar *val;
+	gchar *querystr;
+	GList *gone = NULL;
+
+	querystr = g_strdup_printf("path.BeginsWith(%s%c)", path, G_DIR_SEPARATOR);
+	query = hashfs_db_query_new(querystr);
+	result = hashfs_db_query_result(query);
+
+	for (gint i = 0; i < hashfs_db_result_num(result); i++) {
+		entry = hashfs_db_result_get_entry(result, i);
+
+		if (hashfs_db_entry_lookup(entry, "path", &val) && hashfs_watch_under(val, path))
+			gone = g_list_prepend(gone, g_strdup(val));
+
+		hashfs_db_entry_destroy(entry);
+	}
+
+	hashfs_db_result_destroy(result);
+	hashfs_db_query_destroy(query);
+	g_free(querystr);
+
+	HASHFS_DEBUG("Directory (%s) moved away with %u files", path, g_list_length(gone));
+
+	for (GList *item = gone; item; item = g_list_next(item))
+		hashfs_file_remove(item->data);
+
+	g_list_free_full(gone, g_free);
+}
+
+/* Files moved out of the watched directories, both halves of a rename
+   are queued together so anything left unpaired is gone */
+static void
+hashfs_watch_moved_away (hashfs_watch_t *watch)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, watch->moves);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		g_hash_table_remove(watch->pending, value);
+		hashfs_file_remove(value);
+
+		g_hash_table_iter_remove(&iter);
+	}
+
+	g_hash_table_iter_init(&iter, watch->dir_moves);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		hashfs_watch_dir_forget(value);
+
+		g_hash_table_iter_remove(&iter);
+	}
+}
+
+static void
+hashfs_watch_read (hashfs_watch_t *watch, gchar *buf)
+{
+	struct inotify_event *event;
+	gssize len, pos;
+
+	while ((len = read(watch->fd, buf, WATCH_BUFSIZE)) > 0) {
+		for (pos = 0; pos < len; pos += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *) (buf + pos);
+
+			hashfs_watch_event(watch, event);
+		}
+	}
+
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		HASHFS_LOG("Failed to read events: %s", g_strerror(errno));
+
+	hashfs_watch_moved_away(watch);
+}
+
+/* Milliseconds until the next file settles, -1 with none queued */
+static gint
+hashfs_watch_due (hashfs_watch_t *watch)
+{
+	GHashTableIter iter;
+	gpointer value;
+	gint64 next = G_MAXINT64;
+
+	g_hash_table_iter_init(&iter, watch->pending);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		next = MIN(next, *(gint64 *) value);
+
+	if (next == G_MAXINT64)
+		return -1;
+
+	return (gint) MAX((next - g_get_monotonic_time() + 999) / 1000, 0);
+}
+
+/* Hash and look up a batch of settled files, files already handled
+   like they are now are left out */
+static gpointer
+hashfs_watch_thread (gpointer data)
+{
+	hashfs_watch_t *watch = data;
+	hashfs_update_t *update;
+	GList *paths;
+
+	while ((paths = g_async_queue_pop(watch->settled)) != (gpointer) &watch_end) {
+		HASHFS_LOG("%u new or changed files", g_list_length(paths));
+
+		update = hashfs_update_new(watch->backends, TRUE);
+
+		for (GList *item = paths; item; item = g_list_next(item))
+			hashfs_update_scan(update, item->data);
+
+		hashfs_update_run(update);
+		hashfs_update_destroy(update);
+
+		g_list_free_full(paths, g_free);
+	}
+
+	return NULL;
+}
+
+/* Hand the files nothing happened to for a while to the update thread */
+static void
+hashfs_watch_settle (hashfs_watch_t *watch)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GList *paths = NULL;
+	gint64 now;
+
+	now = g_get_monotonic_time();
+
+	g_hash_table_iter_init(&iter, watch->pending);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (*(gint64 *) value <= now) {
+			paths = g_list_prepend(paths, g_strdup(key));
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	if (paths)
+		g_async_queue_push(watch->settled, paths);
+}
+
+/* Hands files written, moved or copied into watched directories to
+   backends once they stopped changing, and drops the entries of files
+   deleted or moved away */
+hashfs_watch_t *
+hashfs_watch_new (GList *backends)
+{
+	hashfs_watch_t *watch;
+
+	watch = g_new0(hashfs_watch_t, 1);
+	watch->backends = g_list_copy(backends);
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	watch->dirs = g_hash_table_new_full(g_int_hash, g_int_equal, g_free, g_free);
+	watch->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	watch->moves = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	watch->dir_moves = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	watch->settled = g_async_queue_new();
+	watch->settle = (gint64) hashfs_config_property_lookup_int("hashfs", "watch_settle_ms") * 1000;
+
+	if (watch->fd < 0)
+		HASHFS_LOG("Failed to set up inotify: %s", g_strerror(errno));
+
+	return watch;
+}
+
+gboolean
+hashfs_watch_add (hashfs_watch_t *watch, const gchar *path)
+{
+	if (watch->fd < 0 || !hashfs_watch_dir_add(watch, path, FALSE))
+		return FALSE;
+
+	watch->roots = g_list_append(watch->roots, g_strdup(path));
+
+	return TRUE;
+}
+
+/* Runs until interrupted */
+void
+hashfs_watch_run (hashfs_watch_t *watch)
+{
+	struct sigaction action = { 0 }, oldint, oldterm;
+	struct pollfd pfd;
+	gint timeout, due, unsettled;
+	GList *paths;
+	gchar *buf;
+
+	if (watch->fd < 0 || !watch->roots)
+		return;
+
+	/* No SA_RESTART, poll has to return on a signal */
+	action.sa_handler = hashfs_watch_signal;
+	sigaction(SIGINT, &action, &oldint);
+	sigaction(SIGTERM, &action, &oldterm);
+
+	watch_stop = 0;
+
+	buf = g_malloc(WATCH_BUFSIZE);
+
+	pfd.fd = watch->fd;
+	pfd.events = POLLIN;
+
+	HASHFS_LOG("Watching %u directories", g_hash_table_size(watch->dirs));
+
+	watch->thread = g_thread_new("hashfs-settle", hashfs_watch_thread, watch);
+
+	while (!watch_stop) {
+		timeout = hashfs_watch_due(watch);
+
+		/* Removed entries are committed in time as well */
+		if ((due = hashfs_db_tran_due()) >= 0)
+			timeout = timeout < 0 ? due : MIN(timeout, due);
+
+		if (poll(&pfd, 1, timeout) > 0)
+			hashfs_watch_read(watch, buf);
+
+		if (hashfs_db_tran_due() == 0)
+			hashfs_db_tran_flush();
+
+		if (!watch_stop)
+			hashfs_watch_settle(watch);
+	}
+
+	unsettled = g_hash_table_size(watch->pending);
+
+	/* The update running is finished, the batches after it dropped */
+	while ((paths = g_async_queue_try_pop(watch->settled))) {
+		unsettled += g_list_length(paths);
+		g_list_free_full(paths, g_free);
+	}
+
+	g_async_queue_push(watch->settled, &watch_end);
+	g_thread_join(watch->thread);
+
+	hashfs_db_tran_flush();
+
+	HASHFS_LOG("Stopped watching, %d files left unsettled", unsettled);
+
+	g_free(buf);
+
+	sigaction(SIGINT, &oldint, NULL);
+	sigaction(SIGTERM, &oldterm, NULL);
+}
+
+void
+hashfs_watch_destroy (hashfs_watch_t *watch)
+{
+	if (watch->fd >= 0)
+		close(watch->fd);
+
+	g_hash_table_destroy(watch->moves);
+	g_hash_table_destroy(watch->dir_moves);
+	g_async_queue_unref(watch->settled);
+	g_hash_table_destroy(watch->pending);
+	g_hash_table_destroy(watch->dirs);
+
+	g_list_free_full(watch->roots, g_free);
+	g_list_free(watch->backends);
+
+	g_free(watch);
+}
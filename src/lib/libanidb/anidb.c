@@ -11,7 +11,7 @@
 #include "anidb.h"
 #include "util.h"
 
-extern anidb_result_handler_t anidb_handlers[1024];
+extern anidb_result_handler_t anidb_handlers[];
 static anidb_result_t * anidb_session_cmd (anidb_session_t *session, const char *cmd, ...);
 static void gen_query_va (char *buf, va_list ap);
 static void gen_query (char *buf, ...);
@@ -199,20 +199,8 @@ anidb_session_cmd (anidb_session_t *session, const char *cmd, ...)
 	va_end(ap);
 
 	sock_send(session, out, in);
-	code = atoi(in);
-	res = anidb_result_new(code);
-
-	for (int i = 0; i < LENGTH(anidb_handlers); i++) {
-		if (anidb_handlers[i].func == NULL)
-			break;
-
-		if (anidb_handlers[i].code == code) {
-			anidb_handlers[i].func(res, in);
-			break;
-		}
-	}
 
-	return res;
+	return anidb_result_parse(in);
 }
 
 
@@ -615,6 +603,26 @@ anidb_dict_next (anidb_dict_t *dict)
 	return dict->next;
 }
 
+/* Turn a raw server response into a result */
+anidb_result_t *
+anidb_result_parse (char *data)
+{
+	anidb_result_t *res;
+	int code;
+
+	code = atoi(data);
+	res = anidb_result_new(code);
+
+	for (int i = 0; anidb_handlers[i].func; i++) {
+		if (anidb_handlers[i].code == code) {
+			anidb_handlers[i].func(res, data);
+			break;
+		}
+	}
+
+	return res;
+}
+
 anidb_result_t *
 anidb_result_new (int code)
 {
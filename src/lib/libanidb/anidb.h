@@ -156,6 +156,7 @@ int anidb_dict_get (anidb_dict_t *dict, const char **out);
 
 /* Result */
 anidb_result_t * anidb_result_new (int code);
+anidb_result_t * anidb_result_parse (char *data);
 void anidb_result_ref (anidb_result_t *result);
 void anidb_result_unref (anidb_result_t *result);
 
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <anidb.h>
+
+/* Minimum time spent on each benchmark */
+#define BENCH_NS 500000000LL
+
+typedef struct {
+	const char *name;
+	const char *response;
+} bench_response_t;
+
+static bench_response_t responses[] = {
+	{ "auth",
+	  "200 a1b2c LOGIN ACCEPTED\n" },
+
+	{ "anime",
+	  "230 ANIME\n"
+	  "23|26|26|3|853|4713|0|0|874|16|1997-1998|TV Series|Shinseiki Evangelion|"
+	  "\xe6\x96\xb0\xe4\xb8\x96\xe7\xb4\x80\xe3\x82\xa8\xe3\x83\xb4\xe3\x82\xa1\xe3\x83\xb3\xe3\x82\xb2\xe3\x83\xaa\xe3\x82\xaa\xe3\x83\xb3|"
+	  "Neon Genesis Evangelion|Evangelion'Eva'EVA'NGE|nge'eva|Shin Seiki Evangelion|"
+	  "Action,Apocalypse,Mecha,Psychological,Sci-Fi\n" },
+
+	{ "animedesc",
+	  "233 ANIMEDESC\n"
+	  "0|1|In the year 2015, the world stands on the brink of destruction. "
+	  "Humanity's last hope lies in the hands of Nerv, a special agency under "
+	  "the United Nations, and their Evangelions, giant machines capable of "
+	  "defeating the Angels who herald Earth's ultimate demise.\n" },
+
+	{ "episode",
+	  "240 EPISODE\n"
+	  "21346|23|24|850|60|1|Angel Attack|Shito, Shuurai|\xe4\xbd\xbf\xe5\xbe\x92\xe3\x80\x81\xe8\xa5\xb2\xe6\x9d\xa5|812332800\n" },
+
+	{ "file",
+	  "220 FILE\n"
+	  "43698|23|21346|612|0|1|243380224|90033a52db54437dc4a6041348422d4b|"
+	  "0e2af8d2b1c5c9a8e1f0d5b4a3c2e1f0|2b3c4d5e6f708192a3b4c5d6e7f80910a1b2c3d4|"
+	  "a1b2c3d4|japanese|english|high|DVD|AC3|H264/AVC|640x480|mkv|1440|"
+	  "Chrippa Crapsubs|CC|01|Angel Attack|Shito, Shuurai|\xe4\xbd\xbf\xe5\xbe\x92|"
+	  "26|26|1995-1996|TV Series|Shinseiki Evangelion|"
+	  "\xe6\x96\xb0\xe4\xb8\x96\xe7\xb4\x80\xe3\x82\xa8\xe3\x83\xb4\xe3\x82\xa1|"
+	  "Neon Genesis Evangelion|Action,Mecha,Sci-Fi\n" },
+
+	{ "group",
+	  "250 GROUP\n"
+	  "612|752|120|42|1510|Chrippa Crapsubs|CC|#cc|irc.rizon.net|http://example.org/\n" },
+};
+
+static long long
+bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Parse the same response over and over, results are printed
+   as one JSON object per line */
+static void
+bench_parse (bench_response_t *resp)
+{
+	anidb_result_t *res;
+	char buf[1024];
+	long long start, elapsed;
+	long ops = 0;
+
+	start = bench_now();
+
+	do {
+		for (int i = 0; i < 1000; i++) {
+			/* Handlers are allowed to scribble on the buffer */
+			strncpy(buf, resp->response, sizeof(buf));
+
+			res = anidb_result_parse(buf);
+			anidb_result_unref(res);
+		}
+
+		ops += 1000;
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_NS);
+
+	printf("{\"suite\": \"libanidb\", \"bench\": \"parse_%s\", \"params\": {}, "
+	       "\"ops\": %ld, \"ns_per_op\": %.1f}\n",
+	       resp->name, ops, (double) elapsed / ops);
+}
+
+int
+main (int argc, char *argv[])
+{
+	for (int i = 0; i < sizeof(responses) / sizeof(responses[0]); i++)
+		bench_parse(&responses[i]);
+
+	return 0;
+}
@@ -154,4 +154,6 @@ anidb_result_handler_t anidb_handlers[] = {
 	/* ENCODING */
 	/* SENDMSG */
 	/* USER */
+
+	{ 0, NULL }
 };